@@ -0,0 +1,326 @@
+// Reading the peer's credentials off a unix socket is only available as a GNU extension
+#define _GNU_SOURCE
+
+#include "server.h"
+
+int createSessionState(void) {
+    // The session is shared with the connection handlers since they're the ones changing it
+    session = createSharedRegion("session", sizeof(struct sessionState));
+    if(session == NULL) {
+        return ERR;
+    }
+
+    session->mode = NO_MODE;
+
+    return SUCCESS;
+}
+
+
+void recordMode(int mode) {
+    session->mode = mode;
+}
+
+
+void recordSong(int songNum, unsigned char *notes, unsigned char *durations, int songLen) {
+    if(songNum < 0 || songNum >= MAX_SONGS || songLen > BISC_MAX_SONG_LEN) {
+        return;
+    }
+
+    memcpy(session->songNotes[songNum], notes, songLen);
+    memcpy(session->songDurations[songNum], durations, songLen);
+    session->songLengths[songNum] = songLen;
+}
+
+
+void restoreSession(void) {
+    // Connecting to the device puts the Create back in passive mode so put back what the old server had set up
+    if(session->mode != NO_MODE && biscChangeMode(session->mode) != BISC_SUCCESS) {
+        fprintf(stderr, "%s: Failed to restore device mode.\n", prog);
+    }
+
+    for(int i = 0; i < MAX_SONGS; i++) {
+        if(session->songLengths[i] == 0) {
+            continue;
+        }
+
+        if(biscDefineSong((char)i, session->songNotes[i], session->songDurations[i], session->songLengths[i]) != BISC_SUCCESS) {
+            fprintf(stderr, "%s: Failed to restore song #%d.\n", prog, i);
+        }
+    }
+
+    if(verbosity >= DBL_VERBOSE) printf("%s: Restored device session.\n", prog);
+}
+
+
+int startHandoffListener(void) {
+    handoffListenSocket = bindToUnixPath(handoffSocketPath);
+    if(handoffListenSocket == NO_SOCKET || listen(handoffListenSocket, 1) != 0) {
+        return ERR;
+    }
+
+    // Whoever connects here walks away with the server's sockets so keep everyone else out of it
+    if(chmod(handoffSocketPath, S_IRUSR | S_IWUSR) != 0) {
+        return ERR;
+    }
+
+    return SUCCESS;
+}
+
+
+int isHandoffPeerAllowed(int handoffSocket) {
+    // Only the same user (or root) gets to take over
+    struct ucred peer;
+    socklen_t peerLen = sizeof(peer);
+    if(getsockopt(handoffSocket, SOL_SOCKET, SO_PEERCRED, &peer, &peerLen) != 0) {
+        return 0;
+    }
+
+    if(peer.uid != geteuid() && peer.uid != 0) {
+        fprintf(stderr, "%s: Refusing to hand off to process %d owned by user %d.\n", prog, peer.pid, peer.uid);
+        return 0;
+    }
+
+    // Checking whether a server is still on the socket connects without asking for anything so wait for a real request
+    struct pollfd requestFd;
+    requestFd.fd = handoffSocket;
+    requestFd.events = POLLIN;
+
+    char request;
+    if(poll(&requestFd, 1, HANDOFF_WAIT_MICROS / 1000) != 1 || recv(handoffSocket, &request, 1, 0) != 1 || request != HANDOFF_REQUEST) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+void handOffServer(void) {
+    int handoffSocket = accept(handoffListenSocket, NULL, NULL);
+    if(handoffSocket == -1) {
+        return;
+    }
+
+    if(!isHandoffPeerAllowed(handoffSocket)) {
+        close(handoffSocket);
+        return;
+    }
+
+    if(verbosity > NO_VERBOSE) printf("%s: New server requested to take over.\n", prog);
+
+    struct handoffState state;
+    memset(&state, 0, sizeof(state));
+
+    // The shared memory ring belongs to the connection handler so a client using it can't be moved
+    if(session->sharedMemory) {
+        fprintf(stderr, "%s: Refusing to hand off while a client is using shared memory.\n", prog);
+        send(handoffSocket, &state, sizeof(state), 0);
+        close(handoffSocket);
+        return;
+    }
+
+    // Keep the SIGCHLD handler from closing the client socket while the connection handler steps aside
+    sigset_t childMask;
+    sigset_t oldMask;
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+
+    if(childPid != NO_CHILD) {
+        if(stopConnectionHandler(&state.hasClient) == ERR) {
+            fprintf(stderr, "%s: Refusing to hand off while the connection handler is busy.\n", prog);
+            sigprocmask(SIG_SETMASK, &oldMask, NULL);
+            send(handoffSocket, &state, sizeof(state), 0);
+            close(handoffSocket);
+            return;
+        }
+
+        if(state.hasClient) {
+            state.clientInfo = clientInfo;
+        }
+    }
+
+    state.accepted = 1;
+
+    int fds[MAX_SEND_FDS];
+    int numFds = 0;
+
+    fds[numFds] = listenSocket;
+    numFds++;
+
+    // Pass the handoff socket on too so the new server never has to rebind a path that's still in use
+    fds[numFds] = handoffListenSocket;
+    numFds++;
+
+    if(unixListenSocket != NO_SOCKET) {
+        state.hasUnixSocket = 1;
+        strncpy(state.unixSocketPath, unixSocketPath, UNIX_PATH_LEN - 1);
+        fds[numFds] = unixListenSocket;
+        numFds++;
+    }
+
+    if(state.hasClient) {
+        fds[numFds] = clientSocket;
+        numFds++;
+    }
+
+    state.session = *session;
+
+    // Wait for the new server to say it's up before letting go of anything
+    char ready;
+    if(sendFds(handoffSocket, &state, sizeof(state), fds, numFds) == NETWORK_ERR || recv(handoffSocket, &ready, 1, 0) != 1) {
+        fprintf(stderr, "%s: Failed to hand off to new server.\n", prog);
+        close(handoffSocket);
+
+        // Let the SIGCHLD from the old connection handler through before there's a new one for it to be mistaken for
+        sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+        // Pick the client back up where the old connection handler left off
+        if(state.hasClient) {
+            startConnectionHandler(0);
+        }
+
+        return;
+    }
+
+    if(verbosity > NO_VERBOSE) printf("%s: Handed off to new server.\n", prog);
+
+    close(handoffSocket);
+    handedOff = 1;
+    serverExit(NORMAL_EXIT);
+}
+
+
+int stopConnectionHandler(int *hasClient) {
+    // The connection handler finishes the command it's on before answering so the client never misses a reply
+    __atomic_store_n(&session->handoff, HANDOFF_REQUESTED, __ATOMIC_SEQ_CST);
+    kill(childPid, SIGUSR1);
+
+    // Don't hold up the accept loop behind a long command or a connection handler that never gets back to waiting
+    long deadline = getMonotonicMicros() + HANDOFF_WAIT_MICROS;
+    struct timespec pollTime = {0, HANDOFF_POLL_MICROS * 1000};
+
+    int status;
+    pid_t waitedPid;
+    while((waitedPid = waitpid(childPid, &status, WNOHANG)) == 0) {
+        // Giving up only works if the connection handler hasn't already started exiting, in which case just let it finish
+        int expected = HANDOFF_REQUESTED;
+        if(__atomic_load_n(&session->handoff, __ATOMIC_SEQ_CST) == HANDOFF_REFUSED ||
+           (getMonotonicMicros() >= deadline && __atomic_compare_exchange_n(&session->handoff, &expected, HANDOFF_IDLE, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))) {
+            __atomic_store_n(&session->handoff, HANDOFF_IDLE, __ATOMIC_SEQ_CST);
+            return ERR;
+        }
+
+        nanosleep(&pollTime, NULL);
+    }
+
+    __atomic_store_n(&session->handoff, HANDOFF_IDLE, __ATOMIC_SEQ_CST);
+
+    *hasClient = (waitedPid == childPid && WIFEXITED(status) && WEXITSTATUS(status) == HANDOFF_EXIT);
+    if(!*hasClient) {
+        close(clientSocket);
+    }
+
+    childPid = NO_CHILD;
+    session->sharedMemory = 0;
+    return SUCCESS;
+}
+
+
+void answerHandoff(void) {
+    handoffRequested = 0;
+
+    // Nothing to answer if the listening server already gave up waiting
+    int expected = HANDOFF_REQUESTED;
+
+    // Commands still scheduled to run can't be moved to the new server so turn it down rather than keep it waiting on them
+    if(timerWheel.numTimers != 0) {
+        if(__atomic_compare_exchange_n(&session->handoff, &expected, HANDOFF_REFUSED, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            if(verbosity > NO_VERBOSE) printf("%s: Refusing to hand off connection with commands still scheduled.\n", prog);
+        }
+        return;
+    }
+
+    if(!__atomic_compare_exchange_n(&session->handoff, &expected, HANDOFF_EXITING, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    if(verbosity > NO_VERBOSE) printf("%s: Handing off connection with client.\n", prog);
+
+    // Part of a command sitting in the input buffer goes along with the session
+    memcpy(session->pendingInput, inputBuffer, inputLen);
+    session->pendingInputLen = inputLen;
+    session->pendingDiscard = discardingInput;
+    exit(HANDOFF_EXIT);
+}
+
+
+void takeOverServer(void) {
+    if(verbosity > NO_VERBOSE) printf("%s: Taking over from running server...\n", prog);
+
+    struct sockaddr_un handoffInfo;
+    memset(&handoffInfo, 0, sizeof(handoffInfo));
+    handoffInfo.sun_family = AF_UNIX;
+    strncpy(handoffInfo.sun_path, handoffSocketPath, sizeof(handoffInfo.sun_path) - 1);
+
+    char request = HANDOFF_REQUEST;
+    int handoffSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(handoffSocket == -1 || connect(handoffSocket, (struct sockaddr*)&handoffInfo, sizeof(handoffInfo)) != 0 || send(handoffSocket, &request, 1, 0) != 1) {
+        fprintf(stderr, "%s: Failed to connect to running server at \"%s\": %s\n", prog, handoffSocketPath, strerror(errno));
+        exit(ABNORMAL_EXIT);
+    }
+
+    struct handoffState state;
+    int fds[MAX_SEND_FDS];
+    int numFds = recvFds(handoffSocket, &state, sizeof(state), fds, MAX_SEND_FDS);
+    if(numFds == NETWORK_ERR || !state.accepted || numFds != 2 + state.hasUnixSocket + state.hasClient) {
+        fprintf(stderr, "%s: Running server refused to hand off.\n", prog);
+        exit(ABNORMAL_EXIT);
+    }
+
+    int curFd = 0;
+    listenSocket = fds[curFd];
+    curFd++;
+
+    handoffListenSocket = fds[curFd];
+    curFd++;
+
+    if(state.hasUnixSocket) {
+        unixListenSocket = fds[curFd];
+        unixSocketPath = strdup(state.unixSocketPath);
+        curFd++;
+    }
+
+    if(state.hasClient) {
+        clientSocket = fds[curFd];
+        clientInfo = state.clientInfo;
+        curFd++;
+    }
+
+    // The map starts over since the robot may have been moved while the servers were switching
+    if(createSessionState() == ERR || createMap() == ERR) {
+        fprintf(stderr, "%s: Failed to create session state: %s\n", prog, strerror(errno));
+        exit(ABNORMAL_EXIT);
+    }
+
+    *session = state.session;
+    session->sharedMemory = 0;
+    session->handoff = HANDOFF_IDLE;
+
+    // libbiscuit can't adopt an already open descriptor so reconnect and put the device back the way the old server had it
+    connectToDevice();
+    restoreSession();
+
+    childPid = NO_CHILD;
+
+    // Let the old server exit
+    char ready = 1;
+    send(handoffSocket, &ready, 1, 0);
+    close(handoffSocket);
+
+    if(verbosity >= DBL_VERBOSE) printf("%s: Took over from running server.\n", prog);
+
+    // The client already did its handshake with the old server
+    if(state.hasClient) {
+        startConnectionHandler(0);
+    }
+}
@@ -0,0 +1,423 @@
+#include "server.h"
+
+int createMap(void) {
+    // The map outlives each connection handler since the robot is still in the same place for the next client
+    map = createSharedRegion("map", sizeof(struct occupancyMap));
+    if(map == NULL) {
+        return ERR;
+    }
+
+    map->guard = 0;
+    resetMap();
+
+    // A brand new map has nothing for clients to throw away
+    map->version = 0;
+    map->resetVersion = 0;
+
+    return SUCCESS;
+}
+
+
+void resetMap(void) {
+    // The version keeps counting up so a client asking for changes since before the reset is told to drop what it has
+    for(int i = 0; i < MAP_HASH_SIZE; i++) {
+        map->hash[i] = NO_TILE;
+    }
+
+    map->version++;
+    map->resetVersion = map->version;
+    map->droppedUpdates = 0;
+    map->numTiles = 0;
+    map->pose.x = 0;
+    map->pose.y = 0;
+    map->pose.heading = 0;
+    map->rightVelocity = 0;
+    map->leftVelocity = 0;
+    map->lastUpdate = getMonotonicMicros();
+}
+
+
+struct mapTile* getMapTile(int cellX, int cellY, int create) {
+    int tileX = cellX >> MAP_TILE_BITS;
+    int tileY = cellY >> MAP_TILE_BITS;
+
+    // There are twice as many hash slots as tiles so there is always an empty slot to stop at
+    unsigned int slot = ((unsigned int)tileX * 73856093u ^ (unsigned int)tileY * 19349663u) & (MAP_HASH_SIZE - 1);
+    while(map->hash[slot] != NO_TILE) {
+        struct mapTile *tile = &map->tiles[map->hash[slot]];
+        if(tile->tileX == tileX && tile->tileY == tileY) {
+            return tile;
+        }
+
+        slot = (slot + 1) & (MAP_HASH_SIZE - 1);
+    }
+
+    if(!create || map->numTiles == MAP_MAX_TILES) {
+        return NULL;
+    }
+
+    struct mapTile *tile = &map->tiles[map->numTiles];
+    memset(tile, 0, sizeof(struct mapTile));
+    tile->tileX = tileX;
+    tile->tileY = tileY;
+
+    map->hash[slot] = map->numTiles;
+    map->numTiles++;
+
+    return tile;
+}
+
+
+void updateMapCell(double x, double y, int step) {
+    int cellX = (int)floor(x / MAP_CELL_SIZE);
+    int cellY = (int)floor(y / MAP_CELL_SIZE);
+
+    // Once the pool is used up the rest of the room goes unmapped, and unmapped cells never block the guard
+    struct mapTile *tile = getMapTile(cellX, cellY, 1);
+    if(tile == NULL) {
+        if(map->droppedUpdates == 0) {
+            fprintf(stderr, "%s: Map is full; areas outside the %d mapped tiles will not be recorded.\n", prog, MAP_MAX_TILES);
+        }
+
+        map->droppedUpdates++;
+        return;
+    }
+
+    signed char *cell = &tile->cells[(cellY & (MAP_TILE_SIZE - 1)) * MAP_TILE_SIZE + (cellX & (MAP_TILE_SIZE - 1))];
+    int value = *cell + step;
+    if(value < MAP_CELL_MIN) {
+        value = MAP_CELL_MIN;
+    } else if(value > MAP_CELL_MAX) {
+        value = MAP_CELL_MAX;
+    }
+
+    // Only count real changes so driving back and forth over known floor doesn't send the same tiles again
+    if(value != *cell) {
+        *cell = value;
+        map->version++;
+        tile->version = map->version;
+    }
+}
+
+
+void markFootprint(double x, double y) {
+    int minX = (int)floor((x - ROBOT_RADIUS) / MAP_CELL_SIZE);
+    int maxX = (int)floor((x + ROBOT_RADIUS) / MAP_CELL_SIZE);
+    int minY = (int)floor((y - ROBOT_RADIUS) / MAP_CELL_SIZE);
+    int maxY = (int)floor((y + ROBOT_RADIUS) / MAP_CELL_SIZE);
+
+    // Everything under the robot is floor it has driven over
+    for(int cellY = minY; cellY <= maxY; cellY++) {
+        for(int cellX = minX; cellX <= maxX; cellX++) {
+            double centerX = (cellX + 0.5) * MAP_CELL_SIZE;
+            double centerY = (cellY + 0.5) * MAP_CELL_SIZE;
+            if((centerX - x)*(centerX - x) + (centerY - y)*(centerY - y) <= ROBOT_RADIUS*ROBOT_RADIUS) {
+                updateMapCell(centerX, centerY, MAP_FREE_STEP);
+            }
+        }
+    }
+}
+
+
+int isFootprintClear(double x, double y) {
+    int minX = (int)floor((x - ROBOT_RADIUS) / MAP_CELL_SIZE);
+    int maxX = (int)floor((x + ROBOT_RADIUS) / MAP_CELL_SIZE);
+    int minY = (int)floor((y - ROBOT_RADIUS) / MAP_CELL_SIZE);
+    int maxY = (int)floor((y + ROBOT_RADIUS) / MAP_CELL_SIZE);
+
+    for(int cellY = minY; cellY <= maxY; cellY++) {
+        for(int cellX = minX; cellX <= maxX; cellX++) {
+            // Only cells whose centers are under the robot count
+            double dx = (cellX + 0.5) * MAP_CELL_SIZE - x;
+            double dy = (cellY + 0.5) * MAP_CELL_SIZE - y;
+            if(dx*dx + dy*dy > ROBOT_RADIUS*ROBOT_RADIUS) continue;
+
+            // Tiles that were never created have never seen anything
+            struct mapTile *tile = getMapTile(cellX, cellY, 0);
+            if(tile != NULL && tile->cells[(cellY & (MAP_TILE_SIZE - 1)) * MAP_TILE_SIZE + (cellX & (MAP_TILE_SIZE - 1))] >= MAP_OCCUPIED) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+
+int isLineClear(struct pathPose pose, int distance) {
+    // Check the robot's footprint every few centimeters along the way, but not where it already is so it can always back away
+    int steps = (abs(distance) + ODOMETRY_STEP - 1) / ODOMETRY_STEP;
+    if(steps > MAX_ODOMETRY_STEPS) steps = MAX_ODOMETRY_STEPS;
+
+    for(int i = 0; i < steps; i++) {
+        advancePoseLine(&pose, (double)distance / steps);
+        if(!isFootprintClear(pose.x, pose.y)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+int isArcClear(struct pathPose pose, int radius, double headingChange) {
+    double arcLength = fabs(radius * headingChange * M_PI / 180);
+    int steps = (int)ceil(arcLength / ODOMETRY_STEP);
+    if(steps > MAX_ODOMETRY_STEPS) steps = MAX_ODOMETRY_STEPS;
+
+    for(int i = 0; i < steps; i++) {
+        advancePoseArc(&pose, radius, headingChange / steps);
+        if(!isFootprintClear(pose.x, pose.y)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+int isDriveClear(int radius, int distance) {
+    updateOdometry();
+
+    if(radius == STRAIGHT_RADIUS || radius == STRAIGHT_RADIUS_ALT || radius == NO_RADIUS) {
+        return isLineClear(map->pose, distance);
+    } else if(radius == SPIN_CCW_RADIUS || radius == SPIN_CW_RADIUS) {
+        return 1;
+    }
+
+    // Driving forward on a positive radius curves to the left
+    return isArcClear(map->pose, radius, (double)distance / radius * 180 / M_PI);
+}
+
+
+int isPathClear(struct pathSegment *segments, int numSegments) {
+    // Replay the planned path from where odometry says the robot is now
+    updateOdometry();
+    struct pathPose pose = map->pose;
+
+    for(int i = 0; i < numSegments; i++) {
+        if(segments[i].waitType == PATH_WAIT_DISTANCE) {
+            if(!isLineClear(pose, segments[i].waitArg)) return 0;
+            advancePoseLine(&pose, segments[i].waitArg);
+        } else if(segments[i].radius != NO_RADIUS) {
+            if(!isArcClear(pose, segments[i].radius, segments[i].waitArg)) return 0;
+            advancePoseArc(&pose, segments[i].radius, segments[i].waitArg);
+        } else {
+            // Turning in place never sweeps anything new
+            pose.heading += segments[i].waitArg;
+        }
+    }
+
+    return 1;
+}
+
+
+void advancePoseLine(struct pathPose *pose, double distance) {
+    double heading = pose->heading * M_PI / 180;
+    pose->x += distance * cos(heading);
+    pose->y += distance * sin(heading);
+}
+
+
+void advancePoseArc(struct pathPose *pose, double radius, double headingChange) {
+    // Swing around the center of the turn, which is off to the left for positive radii
+    double heading = pose->heading * M_PI / 180;
+    double centerX = pose->x - radius * sin(heading);
+    double centerY = pose->y + radius * cos(heading);
+
+    pose->heading += headingChange;
+    heading = pose->heading * M_PI / 180;
+    pose->x = centerX + radius * sin(heading);
+    pose->y = centerY - radius * cos(heading);
+}
+
+
+void radiusToWheelVelocities(int velocity, int radius, int *rightVelocity, int *leftVelocity) {
+    if(radius == STRAIGHT_RADIUS || radius == STRAIGHT_RADIUS_ALT || radius == NO_RADIUS) {
+        *rightVelocity = velocity;
+        *leftVelocity  = velocity;
+    } else if(radius == SPIN_CCW_RADIUS) {
+        *rightVelocity = velocity;
+        *leftVelocity  = -velocity;
+    } else if(radius == SPIN_CW_RADIUS) {
+        *rightVelocity = -velocity;
+        *leftVelocity  = velocity;
+    } else {
+        *rightVelocity = (int)lround(velocity * (radius + WHEEL_BASE/2.0) / radius);
+        *leftVelocity  = (int)lround(velocity * (radius - WHEEL_BASE/2.0) / radius);
+    }
+}
+
+
+void updateOdometry(void) {
+    long now = getMonotonicMicros();
+    double elapsed = (now - map->lastUpdate) / 1000000.0;
+    map->lastUpdate = now;
+
+    if(map->rightVelocity == 0 && map->leftVelocity == 0) {
+        return;
+    }
+
+    // libbiscuit doesn't read back the encoders so assume the wheels did what they were told since the last update
+    double distance = (map->rightVelocity + map->leftVelocity) / 2.0 * elapsed;
+    double headingChange = (map->rightVelocity - map->leftVelocity) / (double)WHEEL_BASE * elapsed * 180 / M_PI;
+
+    // Spins move the wheels without moving the center so go by whichever sweeps further
+    double sweep = fmax(fabs(distance), fabs(headingChange * M_PI / 180 * WHEEL_BASE / 2));
+    int steps = (int)ceil(sweep / ODOMETRY_STEP);
+    if(steps < 1) steps = 1;
+    if(steps > MAX_ODOMETRY_STEPS) steps = MAX_ODOMETRY_STEPS;
+
+    for(int i = 0; i < steps; i++) {
+        // Move along the heading halfway through the step so arcs don't drift to the outside
+        map->pose.heading += headingChange / steps / 2;
+        advancePoseLine(&map->pose, distance / steps);
+        map->pose.heading += headingChange / steps / 2;
+
+        markFootprint(map->pose.x, map->pose.y);
+    }
+
+    map->pose.heading = fmod(map->pose.heading, 360);
+}
+
+
+void setOdometryVelocity(int rightVelocity, int leftVelocity) {
+    // Finish off the old velocities up to now before switching to the new ones
+    updateOdometry();
+    map->rightVelocity = rightVelocity;
+    map->leftVelocity = leftVelocity;
+}
+
+
+void recordMapEvent(int event) {
+    // Which way the sensor that fired faces, counterclockwise from straight ahead
+    double offset;
+    switch(event) {
+        case EVENT_BUMP:
+        case EVENT_VIRTUAL_WALL:
+        case EVENT_CLIFF:
+            offset = 0;
+            break;
+        case EVENT_LEFT_BUMP:
+            offset = 45;
+            break;
+        case EVENT_RIGHT_BUMP:
+            offset = -45;
+            break;
+        case EVENT_WALL:
+            offset = -90;
+            break;
+        case EVENT_LEFT_CLIFF:
+            offset = 70;
+            break;
+        case EVENT_FRONT_LEFT_CLIFF:
+            offset = 20;
+            break;
+        case EVENT_FRONT_RIGHT_CLIFF:
+            offset = -20;
+            break;
+        case EVENT_RIGHT_CLIFF:
+            offset = -70;
+            break;
+        default:
+            // Buttons and the like say nothing about the room
+            return;
+    }
+
+    updateOdometry();
+
+    // Whatever set the sensor off is just past the edge of the robot
+    double heading = (map->pose.heading + offset) * M_PI / 180;
+    double reach = ROBOT_RADIUS + MAP_CELL_SIZE / 2.0;
+    updateMapCell(map->pose.x + reach * cos(heading), map->pose.y + reach * sin(heading), MAP_OCCUPIED_STEP);
+
+    if(verbosity >= DBL_VERBOSE) printf("%s: Marked obstacle from event %d at %.0f, %.0f.\n", prog, event,
+        map->pose.x + reach * cos(heading), map->pose.y + reach * sin(heading));
+}
+
+
+int processMapCommand(void) {
+    char *arg = getNextArg();
+
+    // MAP POSE
+    if(arg != NULL && strcmp(arg, PROT_MAP_POSE) == 0) {
+        updateOdometry();
+
+        char reply[BUFFER];
+        snprintf(reply, BUFFER, "%s %.0f %.0f %.0f", PROT_MAP_POSE, map->pose.x, map->pose.y, map->pose.heading);
+        return (queueForClient(reply) == NETWORK_ERR ? ERR : SUCCESS);
+    // MAP CLEAR [distance]
+    } else if(arg != NULL && strcmp(arg, PROT_MAP_CLEAR) == 0) {
+        arg = getNextArg();
+        if(arg == NULL) return ERR;
+        int distance = atoi(arg);
+
+        updateOdometry();
+        return (isLineClear(map->pose, distance) ? SUCCESS : ERR);
+    // MAP GUARD ON/OFF
+    } else if(arg != NULL && strcmp(arg, PROT_MAP_GUARD) == 0) {
+        arg = getNextArg();
+        if(arg == NULL) return ERR;
+
+        if(strcmp(arg, PROT_MAP_ON) == 0) {
+            map->guard = 1;
+        } else if(strcmp(arg, PROT_MAP_OFF) == 0) {
+            map->guard = 0;
+        } else {
+            return ERR;
+        }
+
+        return SUCCESS;
+    // MAP RESET
+    } else if(arg != NULL && strcmp(arg, PROT_MAP_RESET) == 0) {
+        resetMap();
+        return SUCCESS;
+    }
+
+    // MAP [since]
+    unsigned long since = 0;
+    if(arg != NULL) {
+        char *end;
+        since = strtoul(arg, &end, 10);
+        if(*end != '\0') return ERR;
+    }
+
+    updateOdometry();
+
+    // A client that last asked before a reset still has tiles that aren't in the map anymore
+    if(since < map->resetVersion && queueForClient(PROT_MAP_RESET) == NETWORK_ERR) {
+        return ERR;
+    }
+
+    // Only the tiles that changed since the client last asked are sent, followed by the version to ask from next time
+    // and how many updates were lost because the map ran out of tiles
+    for(int i = 0; i < map->numTiles; i++) {
+        if(map->tiles[i].version > since && queueMapTile(&map->tiles[i]) == NETWORK_ERR) {
+            return ERR;
+        }
+    }
+
+    char reply[BUFFER];
+    snprintf(reply, BUFFER, "%s %lu %d %d %lu", PROT_MAP, map->version, MAP_CELL_SIZE, MAP_TILE_SIZE, map->droppedUpdates);
+    return (queueForClient(reply) == NETWORK_ERR ? ERR : SUCCESS);
+}
+
+
+int queueMapTile(struct mapTile *tile) {
+    // TILE [x] [y] [version] [cells], one character per cell row by row: '#' occupied, '.' free and '?' unknown
+    char line[BUFFER];
+    int lineLen = snprintf(line, BUFFER, "%s %d %d %lu ", PROT_MAP_TILE, tile->tileX, tile->tileY, tile->version);
+
+    for(int i = 0; i < MAP_TILE_CELLS; i++) {
+        if(tile->cells[i] >= MAP_OCCUPIED) {
+            line[lineLen + i] = '#';
+        } else if(tile->cells[i] < 0) {
+            line[lineLen + i] = '.';
+        } else {
+            line[lineLen + i] = '?';
+        }
+    }
+    line[lineLen + MAP_TILE_CELLS] = '\0';
+
+    return queueForClient(line);
+}
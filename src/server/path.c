@@ -0,0 +1,217 @@
+#include "server.h"
+
+int processDrivePathCommand(void) {
+    // DRIVE PATH [velocity] [segment] [segment] ...
+    char *arg = getNextArg();
+    int velocity;
+    if(parsePathNumber(arg, &velocity) == ERR || velocity <= 0 || velocity > MAX_WHEEL_VELOCITY) return ERR;
+
+    // The segments are CSV lists. Collect them all before parsing them since strtok() can't do both at once.
+    char *unparsedSegments[MAX_PATH_SEGMENTS];
+    int numUnparsed = 0;
+    while((arg = getNextArg()) != NULL) {
+        if(numUnparsed == MAX_PATH_SEGMENTS) return ERR;
+        unparsedSegments[numUnparsed] = arg;
+        numUnparsed++;
+    }
+    if(numUnparsed == 0) return ERR;
+
+    // Plan the whole path before moving so a malformed segment doesn't leave the robot halfway through it
+    struct pathSegment segments[MAX_PATH_SEGMENTS];
+    struct pathPose pose = {0, 0, 0};
+    int numSegments = 0;
+    for(int i = 0; i < numUnparsed; i++) {
+        if(planPathSegment(unparsedSegments[i], velocity, &pose, segments, &numSegments) == ERR) {
+            if(verbosity >= DBL_VERBOSE) printf("%s: Invalid path segment \"%s\".\n", prog, unparsedSegments[i]);
+            return ERR;
+        }
+    }
+
+    return executePath(segments, numSegments);
+}
+
+
+int planPathSegment(char *segment, int velocity, struct pathPose *pose, struct pathSegment *segments, int *numSegments) {
+    char *type = strtok(segment, ",");
+    if(type == NULL) return ERR;
+
+    // LINE,[distance]
+    if(strcmp(type, PROT_PATH_LINE) == 0) {
+        int distance;
+        if(parsePathNumber(strtok(NULL, ","), &distance) == ERR || strtok(NULL, ",") != NULL) return ERR;
+
+        return addPathLine(distance, velocity, pose, segments, numSegments);
+    // ARC,[radius],[angle]
+    } else if(strcmp(type, PROT_PATH_ARC) == 0) {
+        int radius;
+        if(parsePathNumber(strtok(NULL, ","), &radius) == ERR) return ERR;
+
+        int angle;
+        if(parsePathNumber(strtok(NULL, ","), &angle) == ERR || strtok(NULL, ",") != NULL) return ERR;
+
+        return addPathArc(radius, angle, velocity, pose, segments, numSegments);
+    // TURN,[angle]
+    } else if(strcmp(type, PROT_PATH_TURN) == 0) {
+        int angle;
+        if(parsePathNumber(strtok(NULL, ","), &angle) == ERR || strtok(NULL, ",") != NULL) return ERR;
+
+        return addPathTurn(angle, velocity, pose, segments, numSegments);
+    // POINT,[x],[y]
+    } else if(strcmp(type, PROT_PATH_POINT) == 0) {
+        int x;
+        if(parsePathNumber(strtok(NULL, ","), &x) == ERR) return ERR;
+
+        int y;
+        if(parsePathNumber(strtok(NULL, ","), &y) == ERR || strtok(NULL, ",") != NULL) return ERR;
+
+        // Waypoints are relative to where the path started so turn towards the point from the planned pose and drive to it
+        double dx = x - pose->x;
+        double dy = y - pose->y;
+        int distance = (int)lround(sqrt(dx*dx + dy*dy));
+        if(distance == 0) return SUCCESS;
+
+        double turn = atan2(dy, dx) * 180 / M_PI - pose->heading;
+        turn = fmod(turn, 360);
+        if(turn > 180) {
+            turn -= 360;
+        } else if(turn < -180) {
+            turn += 360;
+        }
+
+        if(addPathTurn((int)lround(turn), velocity, pose, segments, numSegments) == ERR) return ERR;
+        return addPathLine(distance, velocity, pose, segments, numSegments);
+    }
+
+    return ERR;
+}
+
+
+int parsePathNumber(const char *arg, int *value) {
+    // A typo in a segment has to fail the whole path rather than quietly becoming a zero length move
+    if(arg == NULL || *arg == '\0') return ERR;
+
+    char *end;
+    errno = 0;
+    long number = strtol(arg, &end, 10);
+    if(*end != '\0' || errno == ERANGE || number < INT_MIN || number > INT_MAX) return ERR;
+
+    *value = (int)number;
+    return SUCCESS;
+}
+
+
+int addPathLine(int distance, int velocity, struct pathPose *pose, struct pathSegment *segments, int *numSegments) {
+    if(distance == 0) return SUCCESS;
+    if(*numSegments == MAX_PATH_SEGMENTS) return ERR;
+
+    // The sign of the distance decides whether to drive forward or backward
+    int wheelVelocity = (distance > 0 ? velocity : -velocity);
+
+    struct pathSegment *cur = &segments[*numSegments];
+    cur->rightVelocity = wheelVelocity;
+    cur->leftVelocity  = wheelVelocity;
+    cur->waitType      = PATH_WAIT_DISTANCE;
+    cur->waitArg       = distance;
+    cur->radius        = NO_RADIUS;
+    (*numSegments)++;
+
+    advancePoseLine(pose, distance);
+
+    return SUCCESS;
+}
+
+
+int addPathArc(int radius, int angle, int velocity, struct pathPose *pose, struct pathSegment *segments, int *numSegments) {
+    // A zero radius arc is a turn in place, which is what TURN is for
+    if(radius == 0) return ERR;
+    if(angle == 0) return SUCCESS;
+    if(*numSegments == MAX_PATH_SEGMENTS) return ERR;
+
+    // Positive radii curve to the left like the Create's drive command. The sign of the angle decides forward or backward.
+    double centerVelocity = (angle > 0 ? velocity : -velocity);
+    double rightVelocity = centerVelocity * (radius + WHEEL_BASE/2.0) / radius;
+    double leftVelocity  = centerVelocity * (radius - WHEEL_BASE/2.0) / radius;
+
+    // Slow the whole arc down if the outer wheel would exceed the Create's top speed
+    double fastest = fmax(fabs(rightVelocity), fabs(leftVelocity));
+    if(fastest > MAX_WHEEL_VELOCITY) {
+        rightVelocity = rightVelocity * MAX_WHEEL_VELOCITY / fastest;
+        leftVelocity  = leftVelocity  * MAX_WHEEL_VELOCITY / fastest;
+    }
+
+    // The Create measures angles counterclockwise
+    int headingChange = (radius > 0 ? angle : -angle);
+
+    struct pathSegment *cur = &segments[*numSegments];
+    cur->rightVelocity = (int)lround(rightVelocity);
+    cur->leftVelocity  = (int)lround(leftVelocity);
+    cur->waitType      = PATH_WAIT_ANGLE;
+    cur->waitArg       = headingChange;
+    cur->radius        = radius;
+    (*numSegments)++;
+
+    advancePoseArc(pose, radius, headingChange);
+
+    return SUCCESS;
+}
+
+
+int addPathTurn(int angle, int velocity, struct pathPose *pose, struct pathSegment *segments, int *numSegments) {
+    if(angle == 0) return SUCCESS;
+    if(*numSegments == MAX_PATH_SEGMENTS) return ERR;
+
+    // Counterclockwise (positive) turns spin the right wheel forward
+    int wheelVelocity = (angle > 0 ? velocity : -velocity);
+
+    struct pathSegment *cur = &segments[*numSegments];
+    cur->rightVelocity = wheelVelocity;
+    cur->leftVelocity  = -wheelVelocity;
+    cur->waitType      = PATH_WAIT_ANGLE;
+    cur->waitArg       = angle;
+    cur->radius        = NO_RADIUS;
+    (*numSegments)++;
+
+    pose->heading += angle;
+
+    return SUCCESS;
+}
+
+
+int executePath(struct pathSegment *segments, int numSegments) {
+    // Don't start down a path that runs into something already on the map
+    if(map->guard && !isPathClear(segments, numSegments)) {
+        if(verbosity >= DBL_VERBOSE) printf("%s: Path is blocked by a known obstacle.\n", prog);
+        return ERR;
+    }
+
+    // Each segment only changes the wheel velocities and waits on the Create's own distance/angle
+    // feedback so there is no stop between segments. The robot is only stopped at the end.
+    for(int i = 0; i < numSegments; i++) {
+        if(verbosity >= TPL_VERBOSE) printf("%s: Path segment %d: right %d mm/s, left %d mm/s, wait %s %d.\n", prog, i,
+            segments[i].rightVelocity, segments[i].leftVelocity, (segments[i].waitType == PATH_WAIT_DISTANCE ? "distance" : "angle"), segments[i].waitArg);
+
+        if(biscDirectDrive(segments[i].rightVelocity, segments[i].leftVelocity) != BISC_SUCCESS) {
+            biscDriveStop();
+            setOdometryVelocity(0, 0);
+            return ERR;
+        }
+        setOdometryVelocity(segments[i].rightVelocity, segments[i].leftVelocity);
+
+        int waitStatus;
+        if(segments[i].waitType == PATH_WAIT_DISTANCE) {
+            waitStatus = biscWaitDistance(segments[i].waitArg);
+        } else {
+            waitStatus = biscWaitAngle(segments[i].waitArg);
+        }
+
+        if(waitStatus != BISC_SUCCESS) {
+            biscDriveStop();
+            setOdometryVelocity(0, 0);
+            return ERR;
+        }
+    }
+
+    int stopStatus = biscDriveStop();
+    setOdometryVelocity(0, 0);
+    return (stopStatus == BISC_SUCCESS ? SUCCESS : ERR);
+}
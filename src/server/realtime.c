@@ -0,0 +1,148 @@
+// CPU affinity is only available as a GNU extension
+#define _GNU_SOURCE
+
+#include "server.h"
+
+int enterRealtime(void) {
+    // Lock everything we have and will have into memory so a motion never stalls on a page fault
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        fprintf(stderr, "%s: Failed to lock memory: %s\n", prog, strerror(errno));
+        return ERR;
+    }
+
+    prefaultStack();
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(realtimeCpu, &cpus);
+    if(sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        fprintf(stderr, "%s: Failed to pin to CPU %d: %s\n", prog, realtimeCpu, strerror(errno));
+        return ERR;
+    }
+
+    struct sched_param schedParam;
+    memset(&schedParam, 0, sizeof(schedParam));
+    schedParam.sched_priority = REALTIME_PRIORITY;
+    if(sched_setscheduler(0, SCHED_FIFO, &schedParam) != 0) {
+        fprintf(stderr, "%s: Failed to set realtime scheduling: %s\n", prog, strerror(errno));
+        return ERR;
+    }
+
+    if(verbosity > NO_VERBOSE) printf("%s: Running connection in realtime mode on CPU %d.\n", prog, realtimeCpu);
+    return SUCCESS;
+}
+
+
+void prefaultStack(void) {
+    // Touch the stack we'll need now so it's already mapped and locked when commands run
+    volatile char stack[PREFAULT_STACK];
+    for(int i = 0; i < PREFAULT_STACK; i++) {
+        stack[i] = 0;
+    }
+    (void)stack[0];
+}
+
+
+long getMonotonicMicros(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+
+int classifyCommand(const char *command, long *requestedMicros) {
+    int velocity;
+    int radius;
+    int time;
+
+    // Timed commands are compared against how long they were asked to take
+    if(sscanf(command, PROT_WAIT " " PROT_WAIT_TIME " %d", &time) == 1 ||
+       sscanf(command, PROT_DRIVE " " PROT_DRIVE_TIME " %d %d %d", &velocity, &radius, &time) == 3 ||
+       sscanf(command, PROT_DRIVE " " PROT_DRIVE_STRAIGHT " " PROT_DRIVE_TIME " %d %d", &velocity, &time) == 2 ||
+       sscanf(command, PROT_DRIVE " " PROT_DRIVE_SPIN " " PROT_DRIVE_TIME " %d %d", &velocity, &time) == 2) {
+        *requestedMicros = time * 1000L;
+        return COMMAND_TIMED;
+    }
+
+    // Commands handled entirely by the server don't touch the device at all
+    if(strncmp(command, PROT_STATS, sizeof(PROT_STATS) - 1) == 0 ||
+       strncmp(command, PROT_CLOCK, sizeof(PROT_CLOCK) - 1) == 0 ||
+       strncmp(command, PROT_AT " ", sizeof(PROT_AT)) == 0 ||
+       strncmp(command, PROT_AFTER " ", sizeof(PROT_AFTER)) == 0 ||
+       strncmp(command, PROT_CANCEL, sizeof(PROT_CANCEL) - 1) == 0 ||
+       strncmp(command, PROT_MAP, sizeof(PROT_MAP) - 1) == 0) {
+        return COMMAND_LOCAL;
+    }
+
+    // Anything else that waits on the device takes as long as the robot does so its timing says nothing about the server
+    if(strncmp(command, PROT_WAIT " ", sizeof(PROT_WAIT)) == 0 ||
+       strncmp(command, PROT_DRIVE " " PROT_DRIVE_DISTANCE " ", sizeof(PROT_DRIVE " " PROT_DRIVE_DISTANCE)) == 0 ||
+       strncmp(command, PROT_DRIVE " " PROT_DRIVE_STRAIGHT " " PROT_DRIVE_DISTANCE " ", sizeof(PROT_DRIVE " " PROT_DRIVE_STRAIGHT " " PROT_DRIVE_DISTANCE)) == 0 ||
+       strncmp(command, PROT_DRIVE " " PROT_DRIVE_SPIN " " PROT_DRIVE_ANGLE " ", sizeof(PROT_DRIVE " " PROT_DRIVE_SPIN " " PROT_DRIVE_ANGLE)) == 0 ||
+       strncmp(command, PROT_DRIVE " " PROT_DRIVE_PATH " ", sizeof(PROT_DRIVE " " PROT_DRIVE_PATH)) == 0 ||
+       strncmp(command, PROT_LED " " PROT_LED_FLASH " ", sizeof(PROT_LED " " PROT_LED_FLASH)) == 0) {
+        return COMMAND_BLOCKING;
+    }
+
+    // Everything left is a single write to the device
+    return COMMAND_SERIAL;
+}
+
+
+void recordCommandTiming(int commandType, long elapsedMicros, long requestedMicros) {
+    if(commandType == COMMAND_SERIAL) {
+        recordLatency(&serialHistogram, elapsedMicros);
+    } else if(commandType == COMMAND_TIMED) {
+        recordLatency(&timingHistogram, labs(elapsedMicros - requestedMicros));
+    }
+}
+
+
+void recordLatency(struct latencyHistogram *histogram, long micros) {
+    int bucket = 0;
+    while(bucket < HISTOGRAM_BUCKETS - 1 && micros >= (1L << bucket)) {
+        bucket++;
+    }
+
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    if((unsigned long)micros > histogram->max) {
+        histogram->max = micros;
+    }
+}
+
+
+int processStatsCommand(void) {
+    char *arg = getNextArg();
+
+    // STATS RESET
+    if(arg != NULL) {
+        if(strcmp(arg, PROT_STATS_RESET) != 0) return ERR;
+
+        memset(&serialHistogram, 0, sizeof(serialHistogram));
+        memset(&timingHistogram, 0, sizeof(timingHistogram));
+        memset(&scheduleHistogram, 0, sizeof(scheduleHistogram));
+        return SUCCESS;
+    }
+
+    // STATS
+    if(queueHistogram(PROT_STATS_SERIAL, &serialHistogram) == NETWORK_ERR || queueHistogram(PROT_STATS_TIMING, &timingHistogram) == NETWORK_ERR ||
+       queueHistogram(PROT_STATS_SCHEDULE, &scheduleHistogram) == NETWORK_ERR) {
+        return ERR;
+    }
+
+    return SUCCESS;
+}
+
+
+int queueHistogram(const char *name, struct latencyHistogram *histogram) {
+    // [name] [count] [max] [bucket],[bucket],...
+    char line[BUFFER];
+    int lineLen = snprintf(line, BUFFER, "%s %lu %lu ", name, histogram->count, histogram->max);
+
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        lineLen += snprintf(line + lineLen, BUFFER - lineLen, (i == 0 ? "%lu" : ",%lu"), histogram->buckets[i]);
+    }
+
+    return queueForClient(line);
+}
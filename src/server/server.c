@@ -1,11 +1,19 @@
 #include "server.h"
 
 int main(int argc, char **argv) {
+    listenSocket = unixListenSocket = handoffListenSocket = NO_SOCKET;
+
     processCmdLineArgs(argc, argv);
     forkOnStartup();
     installSignalHandlers();
-    connectToDevice();
-    startServer();
+
+    // Either take over the device and sockets from a running server or start from scratch
+    if(takeover) {
+        takeOverServer();
+    } else {
+        connectToDevice();
+        startServer();
+    }
 
     while(1) {
         acceptConnection();
@@ -17,8 +25,53 @@ int main(int argc, char **argv) {
 
 
 int acceptConnection(void) {
-    socklen_t clientInfoSize = sizeof(clientInfo);
-    int tmpClientSocket = accept(listenSocket, (struct sockaddr *)&clientInfo, &clientInfoSize);
+    // Wait for a connection on the TCP or unix socket or for a new server to take over
+    struct pollfd listenFds[3];
+    int numListenFds = 0;
+
+    listenFds[numListenFds].fd = listenSocket;
+    listenFds[numListenFds].events = POLLIN;
+    numListenFds++;
+
+    int handoffListenIndex = -1;
+    if(handoffListenSocket != NO_SOCKET) {
+        handoffListenIndex = numListenFds;
+        listenFds[numListenFds].fd = handoffListenSocket;
+        listenFds[numListenFds].events = POLLIN;
+        numListenFds++;
+    }
+
+    int unixListenIndex = -1;
+    if(unixListenSocket != NO_SOCKET) {
+        unixListenIndex = numListenFds;
+        listenFds[numListenFds].fd = unixListenSocket;
+        listenFds[numListenFds].events = POLLIN;
+        numListenFds++;
+    }
+
+    if(poll(listenFds, numListenFds, -1) <= 0) {
+        return ERR;
+    }
+
+    if(handoffListenIndex != -1 && listenFds[handoffListenIndex].revents & POLLIN) {
+        handOffServer();
+        return ERR; // handOffServer() only returns if the handoff failed
+    }
+
+    // Only accept on a socket that actually has a connection waiting; an error on one says nothing about the others
+    int readySocket;
+    if(listenFds[0].revents & POLLIN) {
+        readySocket = listenSocket;
+    } else if(unixListenIndex != -1 && (listenFds[unixListenIndex].revents & POLLIN)) {
+        readySocket = unixListenSocket;
+    } else {
+        return ERR;
+    }
+
+    // Accept into a local address so a rejected connection doesn't clobber the one belonging to the current client
+    struct sockaddr_storage tmpClientInfo;
+    socklen_t clientInfoSize = sizeof(tmpClientInfo);
+    int tmpClientSocket = accept(readySocket, (struct sockaddr *)&tmpClientInfo, &clientInfoSize);
 
     // If accept() failed, just return so it's called again
     if(tmpClientSocket == -1) {
@@ -26,7 +79,7 @@ int acceptConnection(void) {
     }
     
     if(verbosity > NO_VERBOSE) {
-        char *clientIp = getClientIpAddress();
+        char *clientIp = getClientIpAddress(&tmpClientInfo);
         printf("%s: Got connection from %s.\n", prog, clientIp);
         free(clientIp);
     }
@@ -34,38 +87,68 @@ int acceptConnection(void) {
     // Only allow a connection if one doesn't already exist
     if(childPid == NO_CHILD) {
         clientSocket = tmpClientSocket;
+        clientInfo = tmpClientInfo;
+        return startConnectionHandler(1);
+    } else {
+        if(verbosity > NO_VERBOSE) printf("%s: Rejecting connection due to active existing connection.\n", prog);
+        static const char rejectReply[] = PROT_ERR "\n";
+        send(tmpClientSocket, rejectReply, sizeof(rejectReply)-1, 0);
+        close(tmpClientSocket);
+        return ERR;
+    }
+}
 
-        int pid = fork();
-        if(pid == 0) {
+
+int startConnectionHandler(int handshake) {
+    int pid = fork();
+    if(pid == 0) {
+        connectionHandler = 1;
+        setClientSocketOptions();
+        initTimerWheel();
+
+        // Pick up any partial command left behind by the connection handler this client was handed off from
+        inputLen = session->pendingInputLen;
+        memcpy(inputBuffer, session->pendingInput, inputLen);
+        discardingInput = session->pendingDiscard;
+        session->pendingInputLen = 0;
+        session->pendingDiscard = 0;
+
+        // Carry on without realtime scheduling rather than dropping the client if it can't be set up
+        if(realtimeCpu != NO_CPU) {
+            enterRealtime();
+        }
+
+        // Only let a handoff interrupt the connection while waiting for the next command
+        sigset_t handoffMask;
+        sigemptyset(&handoffMask);
+        sigaddset(&handoffMask, SIGUSR1);
+        sigprocmask(SIG_BLOCK, &handoffMask, NULL);
+
+        // A connection taken over from another server already completed its handshake
+        if(handshake) {
             // Get the hello from the client and tell the client we're ready
             char reply[BUFFER];
-            int recvStatus = recvFromClient(reply);
+            int recvStatus;
+            do {
+                recvStatus = recvFromClient(reply);
+            } while(recvStatus == PARTIAL_COMMAND);
+
             if(recvStatus == NETWORK_ERR || recvStatus == 0 || strcmp(reply, PROT_HELO) != 0 || sendToClient(PROT_REDY) == NETWORK_ERR) {
                 if(verbosity > NO_VERBOSE) fprintf(stderr, "%s: Failed handshake with client.\n", prog);
                 serverExit(ABNORMAL_EXIT);
             }
 
             if(verbosity > NO_VERBOSE) printf("%s: Completed handshake with client.\n", prog);
-
-            handleConnection();
-            return ERR; // handleConnection() should never return, but to make gcc stop showing a warning, it's here
-        } else if(pid != -1) {
-            childPid = pid;
-            return SUCCESS;
-        } else {
-            fprintf(stderr, "%s: Failed to fork process to handle new connection.\n", prog);
-            close(clientSocket);
-            return ERR;
         }
+
+        handleConnection();
+        return ERR; // handleConnection() should never return, but to make gcc stop showing a warning, it's here
+    } else if(pid != -1) {
+        childPid = pid;
+        return SUCCESS;
     } else {
-        if(verbosity > NO_VERBOSE) printf("%s: Rejecting connection due to active existing connection.\n", prog);
-        // Add a newline to the ERR command before sending it (sort of hackish...)
-        char tmpErr[sizeof(PROT_ERR)+1];
-        strncpy(tmpErr, PROT_ERR, sizeof(PROT_ERR));
-        tmpErr[sizeof(PROT_ERR)] = '\n';
-        tmpErr[sizeof(PROT_ERR)+1] = '\0';
-        send(tmpClientSocket, tmpErr, sizeof(PROT_ERR)+1, 0);
-        close(tmpClientSocket);
+        fprintf(stderr, "%s: Failed to fork process to handle new connection.\n", prog);
+        close(clientSocket);
         return ERR;
     }
 }
@@ -75,7 +158,17 @@ void handleConnection() {
     char command[BUFFER];
 
     while(1) {
-        // Get the command from the client
+        runTimers();
+
+        // Get the command from the client, or go back around if a scheduled command comes due first
+        int waitStatus = waitForClient();
+        if(waitStatus == TIMER_DUE) {
+            continue;
+        } else if(waitStatus == NETWORK_ERR) {
+            if(verbosity > NO_VERBOSE) fprintf(stderr, "%s: Error communicating with client: %s\n", prog, strerror(errno));
+            continue;
+        }
+
         int recvStatus = recvFromClient(command);
         switch(recvStatus) {
             case  0:
@@ -84,7 +177,17 @@ void handleConnection() {
                 break;
             case NETWORK_ERR:
                 if(verbosity > NO_VERBOSE) fprintf(stderr, "%s: Error communicating with client: %s\n", prog, strerror(errno));
-                break;
+                continue;
+            case TIMER_DUE:
+            case PARTIAL_COMMAND:
+                continue;
+            case COMMAND_TOO_LONG:
+                if(verbosity > NO_VERBOSE) fprintf(stderr, "%s: Discarded command longer than %d bytes.\n", prog, BUFFER);
+                queueForClient(PROT_ERR);
+                if(!hasPendingCommand()) {
+                    flushToClient();
+                }
+                continue;
         }
 
         if(verbosity >= DBL_VERBOSE) printf("%s: Client sent command \"%s\".\n", prog, command);
@@ -95,22 +198,52 @@ void handleConnection() {
             break;
         }
 
-        if(processProtocolCommand(command) == ERR) {
+        // Switching to shared memory sends its own ACK since the ring's file descriptors ride along with it
+        if(strcmp(command, PROT_SHM) == 0) {
+            if(startSharedMemory() == ERR) {
+                if(verbosity >= DBL_VERBOSE) printf("%s: Sending ERR reply to client.\n", prog);
+                sendToClient(PROT_ERR);
+            }
+            continue;
+        }
+
+        // Classify the command before it's torn apart by parsing so its timing can be recorded afterwards
+        long requestedMicros = 0;
+        int commandType = classifyCommand(command, &requestedMicros);
+        long startMicros = getMonotonicMicros();
+
+        int commandStatus = processProtocolCommand(command);
+
+        // A command that failed partway through says nothing about how long it normally takes
+        if(commandStatus == SUCCESS) {
+            recordCommandTiming(commandType, getMonotonicMicros() - startMicros, requestedMicros);
+        }
+
+        if(commandStatus == ERR) {
             if(verbosity >= DBL_VERBOSE) printf("%s: Sending ERR reply to client.\n", prog);
-            sendToClient(PROT_ERR);
+            queueForClient(PROT_ERR);
         } else {
             if(verbosity >= DBL_VERBOSE) printf("%s: Sending ACK reply to client.\n", prog);
-            sendToClient(PROT_ACK);
+            queueForClient(PROT_ACK);
+        }
+
+        // Hold the replies until every command the client sent together has been run
+        if(!hasPendingCommand()) {
+            flushToClient();
         }
     }
 
+    flushToClient();
+
     if(verbosity > NO_VERBOSE) printf("%s: Ending connection with client.\n", prog);
+    if(verbosity >= TPL_VERBOSE) printf("%s: Sent %lu replies in %lu writes.\n", prog, repliesQueued, replyWrites);
     serverExit(NORMAL_EXIT);
 }
 
 
 int processProtocolCommand(char *command) {
     char *arg = strtok(command, " ");
+    if(arg == NULL) return ERR;
 
     if(strcmp(arg, PROT_DRIVE) == 0) {
         return processDriveCommand();
@@ -122,6 +255,19 @@ int processProtocolCommand(char *command) {
         return processWaitCommand();
     } else if(strcmp(arg, PROT_MODE) == 0) {
         return processModeCommand();
+    } else if(strcmp(arg, PROT_STATS) == 0) {
+        return processStatsCommand();
+    } else if(strcmp(arg, PROT_CLOCK) == 0) {
+        return processClockCommand();
+    } else if(strcmp(arg, PROT_AT) == 0) {
+        return processScheduleCommand(0);
+    } else if(strcmp(arg, PROT_AFTER) == 0) {
+        return processScheduleCommand(1);
+    } else if(strcmp(arg, PROT_MAP) == 0) {
+        return processMapCommand();
+    } else if(strcmp(arg, PROT_CANCEL) == 0) {
+        cancelTimers();
+        return SUCCESS;
     } else if(strcmp(arg, PROT_BEEP) == 0) {
         return (biscBeep() == BISC_SUCCESS ? SUCCESS : ERR); 
     }
@@ -149,7 +295,12 @@ int processDriveCommand(void) {
         if(arg == NULL) return ERR;
         int radius = atoi(arg);
 
-        return (biscDrive(velocity, radius) == BISC_SUCCESS ? SUCCESS : ERR); 
+        if(biscDrive(velocity, radius) != BISC_SUCCESS) return ERR;
+
+        int rightVelocity, leftVelocity;
+        radiusToWheelVelocities(velocity, radius, &rightVelocity, &leftVelocity);
+        setOdometryVelocity(rightVelocity, leftVelocity);
+        return SUCCESS;
     // DRIVE TIME/DISTANCE
     } else if(strcmp(arg, PROT_DRIVE_TIME) == 0 || strcmp(arg, PROT_DRIVE_DISTANCE) == 0) {
         int driveType;
@@ -171,11 +322,21 @@ int processDriveCommand(void) {
         if(arg == NULL) return ERR;
         int waitArg = atoi(arg);
 
+        if(driveType == 2 && map->guard && !isDriveClear(radius, waitArg)) return ERR;
+
+        int rightVelocity, leftVelocity;
+        radiusToWheelVelocities(velocity, radius, &rightVelocity, &leftVelocity);
+        setOdometryVelocity(rightVelocity, leftVelocity);
+
+        int driveStatus;
         if(driveType == 1) {
-            return (biscTimedDrive(velocity, radius, waitArg) == BISC_SUCCESS ? SUCCESS : ERR); 
+            driveStatus = biscTimedDrive(velocity, radius, waitArg);
         } else {
-            return (biscDriveDistance(velocity, radius, waitArg) == BISC_SUCCESS ? SUCCESS : ERR);
+            driveStatus = biscDriveDistance(velocity, radius, waitArg);
         }
+
+        setOdometryVelocity(0, 0);
+        return (driveStatus == BISC_SUCCESS ? SUCCESS : ERR);
     // DRIVE STRAIGHT
     } else if(strcmp(arg, PROT_DRIVE_STRAIGHT) == 0) {
         arg = getNextArg();
@@ -204,12 +365,25 @@ int processDriveCommand(void) {
         }
 
         if(driveType == 1) {
-            return (biscDriveStraight(velocity) == BISC_SUCCESS ? SUCCESS : ERR);
-        } else if(driveType == 2) {
-            return (biscTimedDriveStraight(velocity, waitArg) == BISC_SUCCESS ? SUCCESS : ERR);
+            if(biscDriveStraight(velocity) != BISC_SUCCESS) return ERR;
+
+            setOdometryVelocity(velocity, velocity);
+            return SUCCESS;
+        }
+
+        if(driveType == 3 && map->guard && !isDriveClear(STRAIGHT_RADIUS, waitArg)) return ERR;
+
+        setOdometryVelocity(velocity, velocity);
+
+        int driveStatus;
+        if(driveType == 2) {
+            driveStatus = biscTimedDriveStraight(velocity, waitArg);
         } else {
-            return (biscDriveDistanceStraight(velocity, waitArg) == BISC_SUCCESS ? SUCCESS : ERR);
+            driveStatus = biscDriveDistanceStraight(velocity, waitArg);
         }
+
+        setOdometryVelocity(0, 0);
+        return (driveStatus == BISC_SUCCESS ? SUCCESS : ERR);
     // DRIVE DIRECT
     } else if(strcmp(arg, PROT_DRIVE_DIRECT) == 0) {
         arg = getNextArg();
@@ -220,7 +394,10 @@ int processDriveCommand(void) {
         if(arg == NULL) return ERR;
         int leftVelocity = atoi(arg);
 
-        return (biscDirectDrive(rightVelocity, leftVelocity) == BISC_SUCCESS ? SUCCESS : ERR); 
+        if(biscDirectDrive(rightVelocity, leftVelocity) != BISC_SUCCESS) return ERR;
+
+        setOdometryVelocity(rightVelocity, leftVelocity);
+        return SUCCESS;
     // DRIVE SPIN
     } else if(strcmp(arg, PROT_DRIVE_SPIN) == 0) {
         arg = getNextArg();
@@ -248,16 +425,34 @@ int processDriveCommand(void) {
            waitArg = atoi(arg);
         }
 
+        // Spinning with a positive velocity turns clockwise
         if(spinType == 1) {
-            return (biscSpin(velocity) == BISC_SUCCESS ? SUCCESS : ERR);
-        } else if(spinType == 2) {
-            return (biscTimedSpin(velocity, waitArg) == BISC_SUCCESS ? SUCCESS : ERR);
+            if(biscSpin(velocity) != BISC_SUCCESS) return ERR;
+
+            setOdometryVelocity(-velocity, velocity);
+            return SUCCESS;
+        }
+
+        setOdometryVelocity(-velocity, velocity);
+
+        int spinStatus;
+        if(spinType == 2) {
+            spinStatus = biscTimedSpin(velocity, waitArg);
         } else {
-            return (biscSpinAngle(velocity, waitArg) == BISC_SUCCESS ? SUCCESS : ERR);
+            spinStatus = biscSpinAngle(velocity, waitArg);
         }
+
+        setOdometryVelocity(0, 0);
+        return (spinStatus == BISC_SUCCESS ? SUCCESS : ERR);
     // DRIVE STOP
     } else if(strcmp(arg, PROT_DRIVE_STOP) == 0) {
-        return (biscDriveStop() == BISC_SUCCESS ? SUCCESS : ERR);
+        if(biscDriveStop() != BISC_SUCCESS) return ERR;
+
+        setOdometryVelocity(0, 0);
+        return SUCCESS;
+    // DRIVE PATH
+    } else if(strcmp(arg, PROT_DRIVE_PATH) == 0) {
+        return processDrivePathCommand();
     }
 
     return ERR;
@@ -366,6 +561,7 @@ int processSongCommand(void) {
 
         int notesLen = 0;
         while(note != NULL) {
+            if(notesLen == BISC_MAX_SONG_LEN) return ERR;
             notes[notesLen] = note[0];
             notesLen++;
             note = strtok(NULL, ",");
@@ -376,6 +572,7 @@ int processSongCommand(void) {
 
         int durationsLen = 0;
         while(duration != NULL) {
+            if(durationsLen == BISC_MAX_SONG_LEN) return ERR;
             durations[durationsLen] = duration[0];
             durationsLen++;
             duration = strtok(NULL, ",");
@@ -385,7 +582,12 @@ int processSongCommand(void) {
             return ERR;
         }
 
-        return (biscDefineSong((char)songNum, notes, durations, notesLen) == BISC_SUCCESS ? SUCCESS : ERR);
+        if(biscDefineSong((char)songNum, notes, durations, notesLen) != BISC_SUCCESS) {
+            return ERR;
+        }
+
+        recordSong(songNum, notes, durations, notesLen);
+        return SUCCESS;
     } else if(strcmp(arg, PROT_SONG_PLAY) == 0) {
         arg = getNextArg();
         if(arg == NULL) return ERR;
@@ -417,7 +619,11 @@ int processWaitCommand(void) {
     } else if(strcmp(waitType, PROT_WAIT_ANGLE) == 0) {
         return (biscWaitAngle(waitArg) == BISC_SUCCESS ? SUCCESS : ERR); 
     } else if(strcmp(waitType, PROT_WAIT_EVENT) == 0) {
-        return (biscWaitEvent(waitArg) == BISC_SUCCESS ? SUCCESS : ERR); 
+        if(biscWaitEvent(waitArg) != BISC_SUCCESS) return ERR;
+
+        // Bumps, cliffs and walls are the only things the robot can tell us about its surroundings
+        recordMapEvent(waitArg);
+        return SUCCESS;
     }
 
     return ERR;
@@ -440,7 +646,12 @@ int processModeCommand(void) {
         return ERR;
     }
 
-    return (biscChangeMode(mode) == BISC_SUCCESS ? SUCCESS : ERR); 
+    if(biscChangeMode(mode) != BISC_SUCCESS) {
+        return ERR;
+    }
+
+    recordMode(mode);
+    return SUCCESS;
 }
 
 
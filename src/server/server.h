@@ -5,24 +5,43 @@
 #include <getopt.h>
 #include <signal.h>
 #include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
 #include "bisc.h"
 
 
-#define SUCCESS        0
-#define ERR            1
-#define NETWORK_ERR   -1
-#define NORMAL_EXIT    0
-#define ABNORMAL_EXIT  1
+#define SUCCESS           0
+#define ERR               1
+#define NETWORK_ERR      -1
+#define TIMER_DUE        -2
+#define PARTIAL_COMMAND  -3
+#define COMMAND_TOO_LONG -4
+#define NORMAL_EXIT       0
+#define ABNORMAL_EXIT     1
+#define HANDOFF_EXIT      2
 
 #define NO_CHILD       -1
+#define NO_SOCKET      -1
 #define BUFFER         1024
+#define OUTPUT_BUFFER  (BUFFER * 4)
 #define BACKLOG        10
 #define DEFAULT_DEVICE "/dev/ttyUSB0"
 #define DEFAULT_IP     "127.0.0.1"
@@ -39,6 +58,28 @@
 #define PROT_ERR    "ERR"
 #define PROT_END    "END"
 #define PROT_BEEP   "BEEP"
+#define PROT_SHM    "SHM"
+
+#define PROT_CLOCK  "CLOCK"
+#define PROT_AT     "AT"
+#define PROT_AFTER  "AFTER"
+    #define PROT_SCHEDULED_ERR "SCHEDULED ERR"
+#define PROT_CANCEL "CANCEL"
+
+#define PROT_MAP    "MAP"
+    #define PROT_MAP_TILE  "TILE"
+    #define PROT_MAP_POSE  "POSE"
+    #define PROT_MAP_CLEAR "CLEAR"
+    #define PROT_MAP_GUARD "GUARD"
+    #define PROT_MAP_RESET "RESET"
+    #define PROT_MAP_ON    "ON"
+    #define PROT_MAP_OFF   "OFF"
+
+#define PROT_STATS  "STATS"
+    #define PROT_STATS_SERIAL   "SERIAL"
+    #define PROT_STATS_TIMING   "TIMING"
+    #define PROT_STATS_SCHEDULE "SCHEDULE"
+    #define PROT_STATS_RESET    "RESET"
 
 #define PROT_DRIVE  "DRIVE"
     #define PROT_DRIVE_NORMAL   "NORMAL"
@@ -49,6 +90,11 @@
     #define PROT_DRIVE_DIRECT   "DIRECT"
     #define PROT_DRIVE_SPIN     "SPIN"
     #define PROT_DRIVE_STOP     "STOP"
+    #define PROT_DRIVE_PATH     "PATH"
+        #define PROT_PATH_LINE  "LINE"
+        #define PROT_PATH_ARC   "ARC"
+        #define PROT_PATH_TURN  "TURN"
+        #define PROT_PATH_POINT "POINT"
 
 #define PROT_LED    "LED"
     #define PROT_LED_ADVANCE "ADVANCE"
@@ -73,8 +119,203 @@
     #define PROT_MODE_SAFE    "SAFE"
     #define PROT_MODE_PASSIVE "PASSIVE"
 
+#define NO_CPU             -1
+#define REALTIME_PRIORITY  80
+#define PREFAULT_STACK     (64 * 1024)
+#define HISTOGRAM_BUCKETS  24
+
+#define COMMAND_SERIAL     0
+#define COMMAND_TIMED      1
+#define COMMAND_BLOCKING   2
+#define COMMAND_LOCAL      3
+
+// Bucket n counts samples of less than 2^n microseconds; the last bucket takes everything longer
+struct latencyHistogram {
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    unsigned long max;
+};
+
+#define NO_TIMER           -1
+#define MAX_TIMERS         128
+#define WHEEL_LEVELS       4
+#define WHEEL_BITS         6
+#define WHEEL_SLOTS        (1 << WHEEL_BITS)
+#define WHEEL_MASK         (WHEEL_SLOTS - 1)
+#define WHEEL_TICK_MICROS  100
+
+// A command waiting in the timer wheel. Timers are linked into their slot by index into the wheel's pool.
+struct timer {
+    long expires;
+    int next;
+    char command[BUFFER];
+};
+
+// Hierarchical timer wheel. Level 0 has one slot per tick and each level above covers a whole turn of
+// the level below it in each slot. Timers are moved down a level as the wheel turns past them.
+struct timerWheel {
+    long currentTick;
+    int numTimers;
+    int freeTimers;
+    int firing;
+    int cancelled;
+    int slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    struct timer timers[MAX_TIMERS];
+};
+
+#define MAX_PATH_SEGMENTS  32
+#define WHEEL_BASE         258
+#define MAX_WHEEL_VELOCITY 500
+
+#define PATH_WAIT_DISTANCE 1
+#define PATH_WAIT_ANGLE    2
+
+#define SHM_RING_SLOTS  64
+#define SHM_SPIN_COUNT  100000
+#define SHM_NAME_LEN    64
+#define SHM_NAME_PREFIX "/asimov-server"
+#define MAX_SEND_FDS    8
+
+#define NO_MODE         -1
+#define MAX_SONGS       16
+#define UNIX_PATH_LEN   108
+#define CACHE_LINE      64
+
+// Single producer, single consumer ring of protocol messages. The head and tail live on their own cache lines
+// so the client and server don't bounce the same line back and forth. A consumer that frees up a slot while
+// the producer is asleep waiting for one rings the producer's doorbell.
+struct shmRing {
+    unsigned int head;
+    char headPad[CACHE_LINE - sizeof(unsigned int)];
+    unsigned int tail;
+    char tailPad[CACHE_LINE - sizeof(unsigned int)];
+    unsigned int consumerSleeping;
+    char consumerPad[CACHE_LINE - sizeof(unsigned int)];
+    unsigned int producerSleeping;
+    char producerPad[CACHE_LINE - sizeof(unsigned int)];
+    char slots[SHM_RING_SLOTS][BUFFER];
+};
+
+// Commands flow from the client to the server and replies flow back
+struct shmRegion {
+    struct shmRing commands;
+    struct shmRing replies;
+};
+
+// State the Create keeps between commands that a restarted server needs to put back
+struct sessionState {
+    int mode;
+    int sharedMemory;
+    int songLengths[MAX_SONGS];
+    unsigned char songNotes[MAX_SONGS][BISC_MAX_SONG_LEN];
+    unsigned char songDurations[MAX_SONGS][BISC_MAX_SONG_LEN];
+
+    // Where the connection handler is in stepping aside for a handoff and whatever part of the next command
+    // the client had sent when it did
+    int handoff;
+    int pendingDiscard;
+    int pendingInputLen;
+    char pendingInput[BUFFER];
+};
+
+#define HANDOFF_IDLE        0
+#define HANDOFF_REQUESTED   1
+#define HANDOFF_REFUSED     2
+#define HANDOFF_EXITING     3
+#define HANDOFF_WAIT_MICROS 2000000
+#define HANDOFF_POLL_MICROS 1000
+#define HANDOFF_REQUEST     1
+
+// Sent from a running server to the server taking over from it. The file descriptors follow in the same
+// order as the flags: TCP and handoff listen sockets, then unix listen socket and client socket if present. The device isn't
+// passed along since libbiscuit can only open it itself, so the new server reconnects and restores the session.
+struct handoffState {
+    int accepted;
+    int hasUnixSocket;
+    int hasClient;
+    char unixSocketPath[UNIX_PATH_LEN];
+    struct sockaddr_storage clientInfo;
+    struct sessionState session;
+};
+
+struct pathSegment {
+    int rightVelocity;
+    int leftVelocity;
+    int waitType;
+    int waitArg;
+    int radius;
+};
+
+struct pathPose {
+    double x;
+    double y;
+    double heading;
+};
+
+// Radii the Create treats specially
+#define NO_RADIUS           0
+#define STRAIGHT_RADIUS     32768
+#define STRAIGHT_RADIUS_ALT 32767
+#define SPIN_CCW_RADIUS     1
+#define SPIN_CW_RADIUS      -1
+
+#define EVENT_BUMP              5
+#define EVENT_LEFT_BUMP         6
+#define EVENT_RIGHT_BUMP        7
+#define EVENT_VIRTUAL_WALL      8
+#define EVENT_WALL              9
+#define EVENT_CLIFF             10
+#define EVENT_LEFT_CLIFF        11
+#define EVENT_FRONT_LEFT_CLIFF  12
+#define EVENT_FRONT_RIGHT_CLIFF 13
+#define EVENT_RIGHT_CLIFF       14
+
+#define ROBOT_RADIUS       165
+#define ODOMETRY_STEP      20
+#define MAX_ODOMETRY_STEPS 1000
+
+#define NO_TILE            -1
+#define MAP_CELL_SIZE      50
+#define MAP_TILE_BITS      4
+#define MAP_TILE_SIZE      (1 << MAP_TILE_BITS)
+#define MAP_TILE_CELLS     (MAP_TILE_SIZE * MAP_TILE_SIZE)
+#define MAP_MAX_TILES      512
+#define MAP_HASH_SIZE      1024
+#define MAP_CELL_MIN       -16
+#define MAP_CELL_MAX       64
+#define MAP_FREE_STEP      -1
+#define MAP_OCCUPIED_STEP  32
+#define MAP_OCCUPIED       16
+
+// A square block of cells kept together so nearby lookups stay in the same few cache lines. Cells hold how sure
+// we are that they're occupied: negative is free, zero is unknown and positive is occupied.
+struct mapTile {
+    int tileX;
+    int tileY;
+    unsigned long version;
+    signed char cells[MAP_TILE_CELLS];
+};
+
+// Occupancy grid around the robot built from odometry and the sensor events it waits on. Tiles are only
+// handed out from the pool as the robot reaches new areas and are found through an open addressed hash.
+struct occupancyMap {
+    int guard;
+    unsigned long version;
+    unsigned long resetVersion;
+    unsigned long droppedUpdates;
+    struct pathPose pose;
+    long lastUpdate;
+    int rightVelocity;
+    int leftVelocity;
+    int numTiles;
+    int hash[MAP_HASH_SIZE];
+    struct mapTile tiles[MAP_MAX_TILES];
+};
+
 
 int listenSocket;
+int unixListenSocket;
+int handoffListenSocket;
 int clientSocket;
 struct addrinfo *serverInfo;
 struct sockaddr_storage clientInfo;
@@ -82,24 +323,64 @@ struct sockaddr_storage clientInfo;
 char *prog;
 char *device;
 char *port;
+char *unixSocketPath;
+char *handoffSocketPath;
+int connectionHandler;
+int takeover;
+int realtimeCpu;
+int handedOff;
+volatile sig_atomic_t handoffRequested;
+struct sessionState *session;
 int noFork;
 int verbosity;
 int childPid;
 
 
+char inputBuffer[BUFFER];
+int inputLen;
+int discardingInput;
+char outputBuffer[OUTPUT_BUFFER];
+int outputLen;
+unsigned long repliesQueued;
+unsigned long replyWrites;
+
+struct timerWheel timerWheel;
+struct occupancyMap *map;
+
+struct latencyHistogram serialHistogram;
+struct latencyHistogram timingHistogram;
+struct latencyHistogram scheduleHistogram;
+
+struct shmRegion *shmRegion;
+int shmCommandDoorbell;
+int shmReplyDoorbell;
+
+
 int sendToClient(const char *msg);
 int recvFromClient(char *reply);
+int queueForClient(const char *msg);
+int flushToClient(void);
+int hasPendingCommand(void);
+void setClientSocketOptions(void);
+int sendFdsToClient(const char *msg, int *fds, int numFds);
+int sendFds(int socket, void *data, int dataLen, int *fds, int numFds);
+int recvFds(int socket, void *data, int dataLen, int *fds, int maxFds);
+int waitForClient(void);
 
 int startServer(void);
 void stopServer(void);
 int getServerInfo(char *port);
 int bindToSocket(void);
+int bindToUnixSocket(void);
+int bindToUnixPath(const char *path);
 int acceptConnection(void);
+int startConnectionHandler(int handshake);
 void handleConnection(void);
 void commandLoop(void);
 int processProtocolCommand(char *command);
 char* getNextArg(void);
-char* getClientIpAddress(void);
+void* createSharedRegion(const char *label, size_t size);
+char* getClientIpAddress(struct sockaddr_storage *info);
 
 int processDriveCommand(void);
 int processLedCommand(void);
@@ -107,6 +388,71 @@ int processSongCommand(void);
 int processWaitCommand(void);
 int processModeCommand(void);
 
+int startSharedMemory(void);
+void stopSharedMemory(void);
+int sendToSharedMemory(const char *msg);
+int recvFromSharedMemory(char *reply);
+int sleepOnDoorbell(long deadline);
+
+int createSessionState(void);
+void recordMode(int mode);
+void recordSong(int songNum, unsigned char *notes, unsigned char *durations, int songLen);
+void restoreSession(void);
+int startHandoffListener(void);
+int isHandoffPeerAllowed(int handoffSocket);
+void handOffServer(void);
+void takeOverServer(void);
+int stopConnectionHandler(int *hasClient);
+void answerHandoff(void);
+
+int enterRealtime(void);
+void prefaultStack(void);
+long getMonotonicMicros(void);
+int classifyCommand(const char *command, long *requestedMicros);
+void recordCommandTiming(int commandType, long elapsedMicros, long requestedMicros);
+void recordLatency(struct latencyHistogram *histogram, long micros);
+int processStatsCommand(void);
+int queueHistogram(const char *name, struct latencyHistogram *histogram);
+
+void initTimerWheel(void);
+int addTimer(long expires, const char *command);
+void addTimerToWheel(int timer);
+void cascadeTimers(int level, int slot);
+void runTimers(void);
+void fireTimer(int timer);
+long getTimerTimeout(void);
+void cancelTimers(void);
+int processClockCommand(void);
+int processScheduleCommand(int relative);
+int isSchedulableCommand(const char *command);
+
+int createMap(void);
+void resetMap(void);
+struct mapTile* getMapTile(int cellX, int cellY, int create);
+void updateMapCell(double x, double y, int step);
+void markFootprint(double x, double y);
+int isFootprintClear(double x, double y);
+int isLineClear(struct pathPose pose, int distance);
+int isArcClear(struct pathPose pose, int radius, double headingChange);
+int isDriveClear(int radius, int distance);
+int isPathClear(struct pathSegment *segments, int numSegments);
+void advancePoseLine(struct pathPose *pose, double distance);
+void advancePoseArc(struct pathPose *pose, double radius, double headingChange);
+void radiusToWheelVelocities(int velocity, int radius, int *rightVelocity, int *leftVelocity);
+void updateOdometry(void);
+void setOdometryVelocity(int rightVelocity, int leftVelocity);
+void recordMapEvent(int event);
+int processMapCommand(void);
+int queueMapTile(struct mapTile *tile);
+
+int processDrivePathCommand(void);
+int planPathSegment(char *segment, int velocity, struct pathPose *pose, struct pathSegment *segments, int *numSegments);
+int parsePathNumber(const char *arg, int *value);
+int addPathLine(int distance, int velocity, struct pathPose *pose, struct pathSegment *segments, int *numSegments);
+int addPathArc(int radius, int angle, int velocity, struct pathPose *pose, struct pathSegment *segments, int *numSegments);
+int addPathTurn(int angle, int velocity, struct pathPose *pose, struct pathSegment *segments, int *numSegments);
+int executePath(struct pathSegment *segments, int numSegments);
+
 void forkOnStartup(void);
 void installSignalHandlers(void);
 void signalHandler(const int signal);
@@ -1,32 +1,245 @@
 #include "server.h"
 
 int sendToClient(const char *msg) {
-    // Add a newline to the end of the message
+    if(queueForClient(msg) == NETWORK_ERR) {
+        return NETWORK_ERR;
+    }
+
+    return flushToClient();
+}
+
+
+int queueForClient(const char *msg) {
+    if(shmRegion != NULL) {
+        return sendToSharedMemory(msg);
+    }
+
+    // Make room if the message plus its newline won't fit behind what's already queued
     int msgLen = strlen(msg);
-    char *newlineMsg = malloc(msgLen + 2);
-    strncpy(newlineMsg, msg, msgLen);
-    newlineMsg[msgLen] = '\n';
-    newlineMsg[msgLen+1] = '\0';
+    if(msgLen + 1 > OUTPUT_BUFFER) {
+        return NETWORK_ERR;
+    } else if(outputLen + msgLen + 1 > OUTPUT_BUFFER && flushToClient() == NETWORK_ERR) {
+        return NETWORK_ERR;
+    }
+
+    memcpy(outputBuffer + outputLen, msg, msgLen);
+    outputBuffer[outputLen + msgLen] = '\n';
+    outputLen += msgLen + 1;
+    repliesQueued++;
+
+    return msgLen + 1;
+}
+
+
+int flushToClient(void) {
+    // Everything queued since the last flush goes out in one write
+    int sentLen = 0;
+    while(sentLen < outputLen) {
+        int ret = send(clientSocket, outputBuffer + sentLen, outputLen - sentLen, 0);
+        replyWrites++;
+
+        if(ret == -1) {
+            outputLen = 0;
+            return NETWORK_ERR;
+        }
+
+        sentLen += ret;
+    }
+
+    outputLen = 0;
+    return sentLen;
+}
+
+
+int sendFdsToClient(const char *msg, int *fds, int numFds) {
+    // Add a newline to the end of the message like any other reply
+    char newlineMsg[BUFFER];
+    int msgLen = snprintf(newlineMsg, BUFFER, "%s\n", msg);
+
+    return sendFds(clientSocket, newlineMsg, msgLen, fds, numFds);
+}
+
 
-    int ret = send(clientSocket, newlineMsg, msgLen+1, 0);
-    free(newlineMsg);
-    return ret;
+int sendFds(int socket, void *data, int dataLen, int *fds, int numFds) {
+    if(numFds > MAX_SEND_FDS) return NETWORK_ERR;
+
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = dataLen;
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_SEND_FDS)];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msgHeader;
+    memset(&msgHeader, 0, sizeof(msgHeader));
+    msgHeader.msg_iov = &iov;
+    msgHeader.msg_iovlen = 1;
+    msgHeader.msg_control = control;
+    msgHeader.msg_controllen = CMSG_SPACE(sizeof(int) * numFds);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgHeader);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * numFds);
+
+    return sendmsg(socket, &msgHeader, 0);
+}
+
+
+int recvFds(int socket, void *data, int dataLen, int *fds, int maxFds) {
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = dataLen;
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_SEND_FDS)];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msgHeader;
+    memset(&msgHeader, 0, sizeof(msgHeader));
+    msgHeader.msg_iov = &iov;
+    msgHeader.msg_iovlen = 1;
+    msgHeader.msg_control = control;
+    msgHeader.msg_controllen = sizeof(control);
+
+    if(recvmsg(socket, &msgHeader, MSG_WAITALL) != dataLen) {
+        return NETWORK_ERR;
+    }
+
+    // Return how many descriptors came along with the data
+    int numFds = 0;
+    struct cmsghdr *cmsg;
+    for(cmsg = CMSG_FIRSTHDR(&msgHeader); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgHeader, cmsg)) {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        int cmsgFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if(numFds + cmsgFds > maxFds) return NETWORK_ERR;
+
+        memcpy(fds + numFds, CMSG_DATA(cmsg), sizeof(int) * cmsgFds);
+        numFds += cmsgFds;
+    }
+
+    return numFds;
 }
 
 
 int recvFromClient(char *reply) {
-    int recvLen = recv(clientSocket, (char*)reply, BUFFER, 0);
-
-    // Remove the newline and/or carriage return character(s) if they exist
-    if(recvLen >= 0) {
-        if(reply[recvLen-2] == '\r') {
-            reply[recvLen-2] = '\0';
-        } else if(reply[recvLen-1] == '\n') {
-            reply[recvLen-1] = '\0';
+    if(shmRegion != NULL) {
+        return recvFromSharedMemory(reply);
+    }
+
+    // Clients may send several commands at once so only read when there isn't a full line buffered already. Only
+    // read once though since waitForClient() is the only place that should block, not the rest of a half-sent command.
+    char *newline = memchr(inputBuffer, '\n', inputLen);
+    if(newline == NULL) {
+        int recvLen = recv(clientSocket, inputBuffer + inputLen, BUFFER - inputLen, 0);
+        if(recvLen <= 0) {
+            return recvLen;
         }
+
+        inputLen += recvLen;
+        newline = memchr(inputBuffer, '\n', inputLen);
+    }
+
+    if(newline == NULL) {
+        // A command longer than the buffer can't be parsed; throw it away along with the rest of it still to come
+        if(inputLen == BUFFER) {
+            inputLen = 0;
+            discardingInput = 1;
+        }
+
+        return PARTIAL_COMMAND;
+    }
+
+    // The tail end of a command that was too long still has to be answered, just not run
+    if(discardingInput) {
+        discardingInput = 0;
+        inputLen -= newline - inputBuffer + 1;
+        memmove(inputBuffer, newline + 1, inputLen);
+        errno = EMSGSIZE;
+        return COMMAND_TOO_LONG;
+    }
+
+    // Remove the newline and/or carriage return character(s)
+    int lineLen = newline - inputBuffer;
+    memcpy(reply, inputBuffer, lineLen);
+    reply[lineLen] = '\0';
+    if(lineLen > 0 && reply[lineLen-1] == '\r') {
+        reply[lineLen-1] = '\0';
+    }
+
+    inputLen -= lineLen + 1;
+    memmove(inputBuffer, newline + 1, inputLen);
+
+    return lineLen + 1;
+}
+
+
+int hasPendingCommand(void) {
+    if(shmRegion != NULL) {
+        return 0;
+    }
+
+    return memchr(inputBuffer, '\n', inputLen) != NULL;
+}
+
+
+void setClientSocketOptions(void) {
+    if(clientInfo.ss_family != AF_INET && clientInfo.ss_family != AF_INET6) {
+        return;
+    }
+
+    // Replies are already batched into a single write so Nagle's algorithm would only hold them back
+    int sockOpt = 1;
+    if(setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &sockOpt, sizeof(sockOpt)) != 0) {
+        if(verbosity > NO_VERBOSE) fprintf(stderr, "%s: Failed to disable Nagle's algorithm: %s\n", prog, strerror(errno));
+    }
+}
+
+
+int waitForClient(void) {
+    // The shared memory transport does its own waiting and there's no need to wait if a command is already buffered
+    if(shmRegion != NULL || hasPendingCommand()) {
+        return SUCCESS;
     }
 
-    return recvLen;
+    // The handoff signal is blocked everywhere except while waiting here so a connection is
+    // only ever handed off between commands
+    sigset_t waitMask;
+    sigprocmask(SIG_SETMASK, NULL, &waitMask);
+    sigdelset(&waitMask, SIGUSR1);
+
+    while(1) {
+        // Wake up in time for the next scheduled command
+        long timeout = getTimerTimeout();
+        if(timeout == 0) {
+            return TIMER_DUE;
+        }
+
+        struct timespec timeoutSpec;
+        timeoutSpec.tv_sec = timeout / 1000000;
+        timeoutSpec.tv_nsec = (timeout % 1000000) * 1000;
+
+        fd_set readFds;
+        FD_ZERO(&readFds);
+        FD_SET(clientSocket, &readFds);
+
+        int selectStatus = pselect(clientSocket+1, &readFds, NULL, NULL, (timeout == -1 ? NULL : &timeoutSpec), &waitMask);
+
+        if(handoffRequested) {
+            answerHandoff();
+        }
+
+        if(selectStatus > 0) {
+            return SUCCESS;
+        } else if(selectStatus == 0) {
+            return TIMER_DUE;
+        } else if(errno != EINTR) {
+            return NETWORK_ERR;
+        }
+    }
 }
 
 
@@ -38,6 +251,18 @@ int startServer(void) {
         exit(ABNORMAL_EXIT);
     }
 
+    // Local clients can skip the TCP stack entirely by connecting to the unix socket
+    unixListenSocket = NO_SOCKET;
+    if(unixSocketPath != NULL && (bindToUnixSocket() == ERR || listen(unixListenSocket, BACKLOG) != 0)) {
+        fprintf(stderr, "%s: Failed to start server on unix socket \"%s\": %s\n", prog, unixSocketPath, strerror(errno));
+        exit(ABNORMAL_EXIT);
+    }
+
+    if(createSessionState() == ERR || createMap() == ERR || (handoffSocketPath != NULL && startHandoffListener() == ERR)) {
+        fprintf(stderr, "%s: Failed to start server: %s\n", prog, strerror(errno));
+        exit(ABNORMAL_EXIT);
+    }
+
     childPid = NO_CHILD;
 
     if(verbosity >= DBL_VERBOSE) printf("%s: Server started.\n", prog);
@@ -51,11 +276,31 @@ void stopServer(void) {
         childPid = NO_CHILD;
     }
 
+    stopSharedMemory();
+
     close(clientSocket);
     close(listenSocket);
 
-    freeaddrinfo(serverInfo);
-    serverInfo = NULL;
+    if(unixListenSocket != NO_SOCKET) {
+        close(unixListenSocket);
+        unixListenSocket = NO_SOCKET;
+
+        // Only the listening server owns the socket file; connection handlers just close their copy
+        // and a server that handed off leaves it for the server that took over
+        if(!connectionHandler && !handedOff) unlink(unixSocketPath);
+    }
+
+    if(handoffListenSocket != NO_SOCKET) {
+        close(handoffListenSocket);
+        handoffListenSocket = NO_SOCKET;
+
+        if(!connectionHandler && !handedOff) unlink(handoffSocketPath);
+    }
+
+    if(serverInfo != NULL) {
+        freeaddrinfo(serverInfo);
+        serverInfo = NULL;
+    }
 }
 
 
@@ -105,8 +350,82 @@ int bindToSocket() {
 }
 
 
-char* getClientIpAddress(void) {
+int bindToUnixSocket(void) {
+    unixListenSocket = bindToUnixPath(unixSocketPath);
+    return (unixListenSocket == NO_SOCKET ? ERR : SUCCESS);
+}
+
+
+int bindToUnixPath(const char *path) {
+    struct sockaddr_un unixInfo;
+    memset(&unixInfo, 0, sizeof(unixInfo));
+
+    if(strlen(path) >= sizeof(unixInfo.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NO_SOCKET;
+    }
+
+    unixInfo.sun_family = AF_UNIX;
+    strncpy(unixInfo.sun_path, path, sizeof(unixInfo.sun_path) - 1);
+
+    int unixSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(unixSocket == -1) {
+        return NO_SOCKET;
+    }
+
+    // Remove a stale socket file left behind by a previous run, but never one a running server is still listening on
+    if(connect(unixSocket, (struct sockaddr*)&unixInfo, sizeof(unixInfo)) == 0) {
+        close(unixSocket);
+        errno = EADDRINUSE;
+        return NO_SOCKET;
+    }
+
+    close(unixSocket);
+    unixSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(unixSocket == -1) {
+        return NO_SOCKET;
+    }
+
+    unlink(path);
+
+    if(bind(unixSocket, (struct sockaddr*)&unixInfo, sizeof(unixInfo)) != 0) {
+        close(unixSocket);
+        return NO_SOCKET;
+    }
+
+    return unixSocket;
+}
+
+
+void* createSharedRegion(const char *label, size_t size) {
+    // Map a zeroed region that forked processes keep sharing. Its name is unlinked right away so nothing else can open it.
+    char shmName[SHM_NAME_LEN];
+    snprintf(shmName, SHM_NAME_LEN, "%s-%s-%d", SHM_NAME_PREFIX, label, getpid());
+
+    int shmFd = shm_open(shmName, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(shmFd == -1) {
+        return NULL;
+    }
+    shm_unlink(shmName);
+
+    if(ftruncate(shmFd, size) != 0) {
+        close(shmFd);
+        return NULL;
+    }
+
+    void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+    close(shmFd);
+
+    return (region == MAP_FAILED ? NULL : region);
+}
+
+
+char* getClientIpAddress(struct sockaddr_storage *info) {
+    if(info->ss_family == AF_UNIX) {
+        return strdup("local unix socket");
+    }
+
     char *ip = malloc(INET6_ADDRSTRLEN);
-    inet_ntop(clientInfo.ss_family, &((struct sockaddr_in*)&clientInfo)->sin_addr, ip, INET6_ADDRSTRLEN);
+    inet_ntop(info->ss_family, &((struct sockaddr_in*)info)->sin_addr, ip, INET6_ADDRSTRLEN);
     return ip;
 }
\ No newline at end of file
@@ -0,0 +1,216 @@
+#include "server.h"
+
+int startSharedMemory(void) {
+    // File descriptors can only be passed over a unix socket
+    if(clientInfo.ss_family != AF_UNIX || shmRegion != NULL) {
+        return ERR;
+    }
+
+    // Create the region under a unique name and unlink it right away so only the client we hand it to can map it
+    char shmName[SHM_NAME_LEN];
+    snprintf(shmName, SHM_NAME_LEN, "%s-%d", SHM_NAME_PREFIX, getpid());
+
+    int shmFd = shm_open(shmName, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(shmFd == -1) {
+        if(verbosity > NO_VERBOSE) fprintf(stderr, "%s: Failed to create shared memory: %s\n", prog, strerror(errno));
+        return ERR;
+    }
+    shm_unlink(shmName);
+
+    if(ftruncate(shmFd, sizeof(struct shmRegion)) != 0) {
+        close(shmFd);
+        return ERR;
+    }
+
+    struct shmRegion *region = mmap(NULL, sizeof(struct shmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+    if(region == MAP_FAILED) {
+        close(shmFd);
+        return ERR;
+    }
+    memset(region, 0, sizeof(struct shmRegion));
+
+    // The doorbells are only rung when the other side has said it's going to sleep
+    shmCommandDoorbell = eventfd(0, 0);
+    shmReplyDoorbell = eventfd(0, 0);
+    if(shmCommandDoorbell == -1 || shmReplyDoorbell == -1) {
+        if(shmCommandDoorbell != -1) close(shmCommandDoorbell);
+        if(shmReplyDoorbell != -1) close(shmReplyDoorbell);
+        munmap(region, sizeof(struct shmRegion));
+        close(shmFd);
+        return ERR;
+    }
+
+    // Hand the region and doorbells to the client along with the ACK, after any replies still queued for it
+    flushToClient();
+    int fds[3] = {shmFd, shmCommandDoorbell, shmReplyDoorbell};
+    if(verbosity >= DBL_VERBOSE) printf("%s: Sending ACK reply to client.\n", prog);
+    int sendStatus = sendFdsToClient(PROT_ACK, fds, 3);
+    close(shmFd);
+
+    if(sendStatus == NETWORK_ERR) {
+        close(shmCommandDoorbell);
+        close(shmReplyDoorbell);
+        munmap(region, sizeof(struct shmRegion));
+        return ERR;
+    }
+
+    shmRegion = region;
+    session->sharedMemory = 1;
+
+    if(verbosity > NO_VERBOSE) printf("%s: Switched client to shared memory transport.\n", prog);
+    return SUCCESS;
+}
+
+
+void stopSharedMemory(void) {
+    if(shmRegion == NULL) {
+        return;
+    }
+
+    munmap(shmRegion, sizeof(struct shmRegion));
+    shmRegion = NULL;
+
+    close(shmCommandDoorbell);
+    close(shmReplyDoorbell);
+}
+
+
+int sendToSharedMemory(const char *msg) {
+    struct shmRing *ring = &shmRegion->replies;
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    // Commands like MAP send more replies than the ring holds so wait for the client to catch up when it's full
+    int spins = 0;
+    while(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == SHM_RING_SLOTS) {
+        if(spins < SHM_SPIN_COUNT) {
+            spins++;
+            continue;
+        }
+
+        // Tell the client to ring our doorbell when it frees a slot and check once more in case it just did
+        __atomic_store_n(&ring->producerSleeping, 1, __ATOMIC_SEQ_CST);
+        if(head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != SHM_RING_SLOTS) {
+            __atomic_store_n(&ring->producerSleeping, 0, __ATOMIC_SEQ_CST);
+            break;
+        }
+
+        int sleepStatus = sleepOnDoorbell(-1);
+        __atomic_store_n(&ring->producerSleeping, 0, __ATOMIC_SEQ_CST);
+
+        if(sleepStatus != SUCCESS) {
+            return NETWORK_ERR;
+        }
+
+        spins = 0;
+    }
+
+    char *slot = ring->slots[head % SHM_RING_SLOTS];
+    strncpy(slot, msg, BUFFER - 1);
+    slot[BUFFER - 1] = '\0';
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+    // Only make a syscall if the client gave up spinning and is blocked on the doorbell
+    if(__atomic_load_n(&ring->consumerSleeping, __ATOMIC_SEQ_CST)) {
+        uint64_t doorbell = 1;
+        if(write(shmReplyDoorbell, &doorbell, sizeof(doorbell)) != sizeof(doorbell)) {
+            return NETWORK_ERR;
+        }
+    }
+
+    return strlen(slot);
+}
+
+
+int recvFromSharedMemory(char *reply) {
+    struct shmRing *ring = &shmRegion->commands;
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    // Stop waiting in time for the next scheduled command
+    long timeout = getTimerTimeout();
+    long deadline = (timeout == -1 ? -1 : getMonotonicMicros() + timeout);
+
+    // Spin for a while before going to sleep so back-to-back commands never touch the kernel
+    int spins = 0;
+    while(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+        if(deadline != -1 && getMonotonicMicros() >= deadline) {
+            return TIMER_DUE;
+        }
+
+        if(spins < SHM_SPIN_COUNT) {
+            spins++;
+            continue;
+        }
+
+        // Tell the client to ring the doorbell and check once more in case a command arrived in between
+        __atomic_store_n(&ring->consumerSleeping, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != tail) {
+            __atomic_store_n(&ring->consumerSleeping, 0, __ATOMIC_SEQ_CST);
+            break;
+        }
+
+        int sleepStatus = sleepOnDoorbell(deadline);
+        __atomic_store_n(&ring->consumerSleeping, 0, __ATOMIC_SEQ_CST);
+
+        // A closed socket reads as zero bytes like recv() would return
+        if(sleepStatus == ERR) {
+            return 0;
+        } else if(sleepStatus == NETWORK_ERR) {
+            return NETWORK_ERR;
+        }
+
+        spins = 0;
+    }
+
+    char *slot = ring->slots[tail % SHM_RING_SLOTS];
+    strncpy(reply, slot, BUFFER - 1);
+    reply[BUFFER - 1] = '\0';
+
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    // Let the client know there's room again if it filled the ring and went to sleep waiting for some
+    if(__atomic_load_n(&ring->producerSleeping, __ATOMIC_SEQ_CST)) {
+        uint64_t doorbell = 1;
+        if(write(shmReplyDoorbell, &doorbell, sizeof(doorbell)) != sizeof(doorbell)) {
+            return NETWORK_ERR;
+        }
+    }
+
+    // Return the same length recv() would have so callers can't tell the transports apart
+    return strlen(reply) + 1;
+}
+
+
+int sleepOnDoorbell(long deadline) {
+    // Also watch the socket so a client that goes away doesn't leave us asleep forever
+    struct pollfd fds[2];
+    fds[0].fd = shmCommandDoorbell;
+    fds[0].events = POLLIN;
+    fds[1].fd = clientSocket;
+    fds[1].events = POLLIN;
+
+    // poll() only has millisecond resolution so wake up early and spin out the rest
+    int pollTimeout = -1;
+    if(deadline != -1) {
+        pollTimeout = (deadline - getMonotonicMicros()) / 1000;
+        if(pollTimeout < 0) pollTimeout = 0;
+    }
+
+    if(poll(fds, 2, pollTimeout) == -1) {
+        return NETWORK_ERR;
+    }
+
+    if(fds[0].revents & POLLIN) {
+        uint64_t rings;
+        if(read(shmCommandDoorbell, &rings, sizeof(rings)) != sizeof(rings)) {
+            return NETWORK_ERR;
+        }
+    }
+
+    // Nothing is sent over the socket once the ring is in use so anything readable on it means it was closed
+    if(fds[1].revents & (POLLIN | POLLHUP)) {
+        return ERR;
+    }
+
+    return SUCCESS;
+}
@@ -0,0 +1,244 @@
+#include "server.h"
+
+void initTimerWheel(void) {
+    for(int level = 0; level < WHEEL_LEVELS; level++) {
+        for(int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            timerWheel.slots[level][slot] = NO_TIMER;
+        }
+    }
+
+    // All timers start out on the free list
+    for(int i = 0; i < MAX_TIMERS; i++) {
+        timerWheel.timers[i].next = (i == MAX_TIMERS - 1 ? NO_TIMER : i + 1);
+    }
+
+    timerWheel.freeTimers = 0;
+    timerWheel.numTimers = 0;
+    timerWheel.firing = 0;
+    timerWheel.cancelled = 0;
+    timerWheel.currentTick = getMonotonicMicros() / WHEEL_TICK_MICROS;
+}
+
+
+int addTimer(long expires, const char *command) {
+    size_t commandLen = strlen(command);
+    if(timerWheel.freeTimers == NO_TIMER || commandLen >= BUFFER) {
+        return ERR;
+    }
+
+    // An empty wheel has nothing to catch up on so jump it straight to now
+    if(timerWheel.numTimers == 0) {
+        timerWheel.currentTick = getMonotonicMicros() / WHEEL_TICK_MICROS;
+    }
+
+    int timer = timerWheel.freeTimers;
+    timerWheel.freeTimers = timerWheel.timers[timer].next;
+    timerWheel.numTimers++;
+
+    timerWheel.timers[timer].expires = expires;
+    memcpy(timerWheel.timers[timer].command, command, commandLen + 1);
+
+    addTimerToWheel(timer);
+    return SUCCESS;
+}
+
+
+void addTimerToWheel(int timer) {
+    // Round up so a timer never fires before it's due
+    long tick = (timerWheel.timers[timer].expires + WHEEL_TICK_MICROS - 1) / WHEEL_TICK_MICROS;
+    long delta = tick - timerWheel.currentTick;
+
+    // Anything already due goes in the next slot to run
+    if(delta < 0) {
+        tick = timerWheel.currentTick;
+        delta = 0;
+    }
+
+    // Timers further out than the wheel reaches wait in its last slot and are put back when it comes around
+    if(delta >= 1L << (WHEEL_BITS * WHEEL_LEVELS)) {
+        delta = (1L << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        tick = timerWheel.currentTick + delta;
+    }
+
+    int level = 0;
+    while(level < WHEEL_LEVELS - 1 && delta >= 1L << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    int slot = (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    timerWheel.timers[timer].next = timerWheel.slots[level][slot];
+    timerWheel.slots[level][slot] = timer;
+}
+
+
+void cascadeTimers(int level, int slot) {
+    int timer = timerWheel.slots[level][slot];
+    timerWheel.slots[level][slot] = NO_TIMER;
+
+    // Now that the wheel is closer, each timer lands on a lower level
+    while(timer != NO_TIMER) {
+        int next = timerWheel.timers[timer].next;
+        addTimerToWheel(timer);
+        timer = next;
+    }
+}
+
+
+void runTimers(void) {
+    if(timerWheel.numTimers == 0) {
+        return;
+    }
+
+    long nowTick = getMonotonicMicros() / WHEEL_TICK_MICROS;
+
+    while(timerWheel.currentTick <= nowTick && timerWheel.numTimers > 0) {
+        int slot = timerWheel.currentTick & WHEEL_MASK;
+
+        // Each time a level wraps around, bring down the next slot from the level above it
+        if(slot == 0) {
+            for(int level = 1; level < WHEEL_LEVELS; level++) {
+                int levelSlot = (timerWheel.currentTick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+                cascadeTimers(level, levelSlot);
+
+                if(levelSlot != 0) break;
+            }
+        }
+
+        // Take the whole slot before firing anything since the commands may schedule more timers
+        int timer = timerWheel.slots[0][slot];
+        timerWheel.slots[0][slot] = NO_TIMER;
+        timerWheel.currentTick++;
+
+        timerWheel.firing = 1;
+        while(timer != NO_TIMER) {
+            int next = timerWheel.timers[timer].next;
+            fireTimer(timer);
+            timer = next;
+
+            // A scheduled CANCEL can't clear the wheel out from under this loop so it's cleared here instead
+            if(timerWheel.cancelled) {
+                initTimerWheel();
+                return;
+            }
+        }
+        timerWheel.firing = 0;
+    }
+}
+
+
+void fireTimer(int timer) {
+    struct timer *cur = &timerWheel.timers[timer];
+
+    // Timers that were too far out for the wheel come around early and just go back in
+    long dueTick = (cur->expires + WHEEL_TICK_MICROS - 1) / WHEEL_TICK_MICROS;
+    if(dueTick >= timerWheel.currentTick) {
+        addTimerToWheel(timer);
+        return;
+    }
+
+    // Copy the command out and free the timer first so the command can schedule another one in its place
+    char command[BUFFER];
+    memcpy(command, cur->command, BUFFER);
+    long lateness = getMonotonicMicros() - cur->expires;
+
+    cur->next = timerWheel.freeTimers;
+    timerWheel.freeTimers = timer;
+    timerWheel.numTimers--;
+
+    recordLatency(&scheduleHistogram, (lateness > 0 ? lateness : 0));
+
+    if(verbosity >= DBL_VERBOSE) printf("%s: Running scheduled command \"%s\" %ld us late.\n", prog, command, lateness);
+
+    if(processProtocolCommand(command) == ERR) {
+        if(verbosity > NO_VERBOSE) fprintf(stderr, "%s: Scheduled command \"%s\" failed.\n", prog, cur->command);
+
+        // Nothing else is going to tell the client so send it a line of its own naming the command right away. The
+        // freed timer still has the command intact since scheduled commands can't schedule more.
+        char reply[OUTPUT_BUFFER];
+        snprintf(reply, OUTPUT_BUFFER, "%s %s", PROT_SCHEDULED_ERR, cur->command);
+        queueForClient(reply);
+        flushToClient();
+    }
+}
+
+
+long getTimerTimeout(void) {
+    if(timerWheel.numTimers == 0) {
+        return -1;
+    }
+
+    // The next timer is either in what's left of this turn of the bottom level or comes down at the next cascade
+    long nextTick = (timerWheel.currentTick | WHEEL_MASK) + 1;
+    for(long tick = timerWheel.currentTick; tick < nextTick; tick++) {
+        if(timerWheel.slots[0][tick & WHEEL_MASK] != NO_TIMER) {
+            nextTick = tick;
+            break;
+        }
+    }
+
+    long timeout = nextTick * WHEEL_TICK_MICROS - getMonotonicMicros();
+    return (timeout > 0 ? timeout : 0);
+}
+
+
+void cancelTimers(void) {
+    // Wait for runTimers() to finish with the timer it's firing if CANCEL was itself scheduled
+    if(timerWheel.firing) {
+        timerWheel.cancelled = 1;
+        return;
+    }
+
+    initTimerWheel();
+}
+
+
+int processClockCommand(void) {
+    // CLOCK replies with the server's monotonic clock in microseconds so clients can work out their offset from it
+    char reply[BUFFER];
+    snprintf(reply, BUFFER, "%s %ld", PROT_CLOCK, getMonotonicMicros());
+
+    return (queueForClient(reply) == NETWORK_ERR ? ERR : SUCCESS);
+}
+
+
+int processScheduleCommand(int relative) {
+    // AT [time] [command] / AFTER [delay] [command]
+    char *arg = getNextArg();
+    if(arg == NULL) return ERR;
+
+    char *end;
+    errno = 0;
+    long when = strtol(arg, &end, 10);
+    if(*end != '\0' || errno == ERANGE) return ERR;
+
+    // The rest of the line is the command to run
+    char *command = strtok(NULL, "");
+    if(command == NULL || !isSchedulableCommand(command)) return ERR;
+
+    // A delay so long it would wrap the clock around would otherwise run right away
+    if(relative) {
+        long now = getMonotonicMicros();
+        if(when < 0 || when > LONG_MAX - now) return ERR;
+        when += now;
+    }
+
+    return addTimer(when, command);
+}
+
+
+int isSchedulableCommand(const char *command) {
+    // A scheduled command has no request of its own to reply to so anything that answers with more than ACK
+    // can't be scheduled, and neither can more scheduling since the timer it's fired from is being freed
+    static const char *unschedulable[] = {PROT_CLOCK, PROT_STATS, PROT_MAP, PROT_AT, PROT_AFTER};
+
+    command += strspn(command, " ");
+    size_t nameLen = strcspn(command, " ");
+
+    for(size_t i = 0; i < sizeof(unschedulable) / sizeof(unschedulable[0]); i++) {
+        if(strlen(unschedulable[i]) == nameLen && strncmp(command, unschedulable[i], nameLen) == 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
@@ -6,24 +6,55 @@ void processCmdLineArgs(int argc, char **argv) {
     // In order to call getopt() more than once, optind must be reset to 1
     optind = 1;
 
+    realtimeCpu = NO_CPU;
+
     static struct option longOpts[] = {
-        {"port",     required_argument, NULL, 'p'},
-        {"no-fork",  no_argument,       NULL, 'f'},
-        {"verbose",  no_argument,       NULL, 'v'},
-        {"version",  no_argument,       NULL, 'V'},
-        {"help",     no_argument,       NULL, 'h'},
-        {NULL,       0,                 0,      0}
+        {"port",           required_argument, NULL, 'p'},
+        {"unix-socket",    required_argument, NULL, 'u'},
+        {"handoff-socket", required_argument, NULL, 'H'},
+        {"takeover",       no_argument,       NULL, 't'},
+        {"realtime",       required_argument, NULL, 'r'},
+        {"no-fork",        no_argument,       NULL, 'f'},
+        {"verbose",        no_argument,       NULL, 'v'},
+        {"version",        no_argument,       NULL, 'V'},
+        {"help",           no_argument,       NULL, 'h'},
+        {NULL,             0,                 0,      0}
     };
 
     // Parse the command line args
     char option;
     int optIndex;
-    while((option = getopt_long(argc, argv, "p:fvVh", longOpts, &optIndex)) != -1) {
+    while((option = getopt_long(argc, argv, "p:u:H:tr:fvVh", longOpts, &optIndex)) != -1) {
         switch (option) {
             // Port
             case 'p':
                 port = optarg;
                 break;
+            // Unix socket
+            case 'u':
+                unixSocketPath = optarg;
+                break;
+            // Handoff socket
+            case 'H':
+                handoffSocketPath = optarg;
+                break;
+            // Take over from a running server
+            case 't':
+                takeover = 1;
+                break;
+            // Run connections with realtime scheduling on the given CPU
+            case 'r': {
+                // atoi() would quietly turn anything that isn't a number into CPU 0
+                char *end;
+                errno = 0;
+                long cpu = strtol(optarg, &end, 10);
+                if(end == optarg || *end != '\0' || errno == ERANGE || cpu < 0 || cpu >= sysconf(_SC_NPROCESSORS_ONLN)) {
+                    fprintf(stderr, "%s: Invalid CPU \"%s\" for realtime mode.\n", prog, optarg);
+                    exit(ABNORMAL_EXIT);
+                }
+                realtimeCpu = (int)cpu;
+                break;
+            }
             // No fork
             case 'f':
                 noFork = 1;
@@ -65,6 +96,11 @@ void processCmdLineArgs(int argc, char **argv) {
         if(verbosity > NO_VERBOSE) printf("%s: Port not specified. Defaulting to \"%s\".\n", prog, DEFAULT_PORT);
         port = DEFAULT_PORT;
     }
+    // Only servers started with a handoff socket can be taken over so there's nothing to connect to without one
+    if(takeover && handoffSocketPath == NULL) {
+        fprintf(stderr, "%s: Taking over a running server requires its handoff socket.\n", prog);
+        exit(ABNORMAL_EXIT);
+    }
 }
 
 
@@ -74,7 +110,7 @@ void installSignalHandlers(void) {
     sa.sa_handler = signalHandler;
     sa.sa_flags = SA_RESTART;
     sigemptyset(&sa.sa_mask);
-    if(sigaction(SIGINT,  &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1 || sigaction(SIGCHLD, &sa, NULL) == -1) {
+    if(sigaction(SIGINT,  &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1 || sigaction(SIGCHLD, &sa, NULL) == -1 || sigaction(SIGUSR1, &sa, NULL) == -1) {
         fprintf(stderr, "%s: Failed to install signal handlers.\n", prog);
         exit(ABNORMAL_EXIT);
     }
@@ -85,12 +121,19 @@ void signalHandler(const int signal) {
     if(signal == SIGINT || signal == SIGTERM) {
         serverExit(NORMAL_EXIT);
     } else if(signal == SIGCHLD) {
-        // When the child returns, set the child pid back to no child so a new client can be accepted
-        pid_t returned_child = wait(NULL);
-        if(returned_child == childPid) {
-            close(clientSocket);
-            childPid = NO_CHILD;
+        // When the child returns, set the child pid back to no child so a new client can be accepted. Don't block
+        // since a handoff may have already reaped the child this signal was for while a new one is running.
+        pid_t returned_child;
+        while((returned_child = waitpid(-1, NULL, WNOHANG)) > 0) {
+            if(returned_child == childPid) {
+                close(clientSocket);
+                childPid = NO_CHILD;
+                session->sharedMemory = 0;
+            }
         }
+    } else if(signal == SIGUSR1) {
+        // The server is handing off to a new process; the connection handler exits once it's between commands
+        handoffRequested = 1;
     }
 }
 